@@ -7,9 +7,13 @@ WLR_PROTO_PREFIX=/home/user/dev/labwc/subprojects/wlr-protocols
 sources=(
 	src/client.c
 	src/allocators/common.c
+	src/allocators/drm.c
 	src/allocators/gbm.c
 	src/allocators/shm.c
+	src/allocators/swapchain.c
 	src/allocators/pool.c
+	src/allocators/pressure.c
+	src/allocators/udmabuf.c
 	src/backends/drm.c
 	src/interfaces/ext_capture.c
 	src/interfaces/ext_foreign_toplevel_list.c
@@ -25,6 +29,7 @@ sources=(
 protocols=(
 	$PROTO_PREFIX/stable/linux-dmabuf/linux-dmabuf-v1.xml
 	$PROTO_PREFIX/stable/xdg-shell/xdg-shell.xml
+	$PROTO_PREFIX/stable/viewporter/viewporter.xml
 	$PROTO_PREFIX/staging/cursor-shape/cursor-shape-v1.xml
 	$PROTO_PREFIX/unstable/tablet/tablet-unstable-v2.xml # required by cursor-shape
 	$PROTO_PREFIX/unstable/xdg-decoration/xdg-decoration-unstable-v1.xml
@@ -58,6 +63,7 @@ libs=(
 	-l wayland-client
 	-l drm
 	-l gbm
+	-l pthread
 )
 
 opts=(
@@ -13,6 +13,7 @@ struct client_handler {
 	void *data;
 };
 
+struct base_memory_pressure;
 struct client {
 	/* client functions */
 	void (*add_handler)(struct client *client, struct client_handler handler);
@@ -32,6 +33,7 @@ struct client {
 		struct zwlr_layer_shell_v1 *layershell_manager;
 		struct zxdg_decoration_manager_v1 *deco_manager;
 		struct wp_cursor_shape_manager_v1 *cursor_shape_manager;
+		struct wp_viewporter *viewporter;
 	} state;
 
 	struct base_allocator *shm_pool;
@@ -42,6 +44,8 @@ struct client {
 	/* Private */
 	bool should_terminate;
 	struct wl_array callbacks;
+	/* May be NULL, idle pool buffers are trimmed on pressure */
+	struct base_memory_pressure *memory_pressure;
 };
 struct client *client_create(void);
 
@@ -49,6 +53,16 @@ struct base_buffer;
 struct base_wl_buffer_manager {
 	struct client *client;
 	struct wl_buffer *(*create_wl_buffer)(struct base_wl_buffer_manager *manager, struct base_buffer *buffer);
+	/*
+	 * Creates the wl_buffer ahead of time without locking the buffer, see
+	 * base_buffer_reservation. Fails for buffers which need staging.
+	 */
+	bool (*prepare_buffer)(struct base_wl_buffer_manager *manager, struct base_buffer *buffer);
+	/*
+	 * Destroys the staging allocator as well, staging buffers still held
+	 * by the compositor are leaked.
+	 */
+	void (*destroy)(struct base_wl_buffer_manager *manager);
 };
 struct base_wl_buffer_manager *base_wl_buffer_manager_create(struct client *client);
 
@@ -95,6 +109,8 @@ struct surface_handler {
 
 // move to surface.h
 struct renderer;
+struct base_rect;
+struct base_swapchain;
 struct surface {
 	struct client *client;
 	struct wl_surface *surface;
@@ -104,6 +120,14 @@ struct surface {
 	void (*add_handler)(struct surface *surface, struct surface_handler handler);
 	void (*set_buffer)(struct surface *surface, struct base_buffer *buffer);
 	void (*set_render_func)(struct surface *surface, void (*render_func)(struct base_buffer *buffer));
+	/*
+	 * Incremental alternative to set_render_func(). buffer_damage is the part of the buffer which
+	 * is outdated (see buffer->age) and has to be repainted in addition to what changes in the new
+	 * frame. The render func reports the changes of the new frame via damage. It should write the
+	 * pixels with a single get_pixels() call, the repainted region is reported as buffer damage.
+	 */
+	void (*set_damage_render_func)(struct surface *surface, void (*render_func)(struct base_buffer *buffer,
+		const struct base_rect *buffer_damage, struct base_rect *damage));
 	void (*request_frame)(struct surface *surface, void (*callback)(struct surface *surface, uint32_t time_ms, void *data), void *data);
 	void (*render_frame)(struct surface *surface, uint32_t width, uint32_t height);
 	void (*unmap)(struct surface *surface);
@@ -123,6 +147,13 @@ struct surface {
 		void *data;
 	} frame_callback;
 	void (*render_func)(struct base_buffer *buffer); /* Defaults to buffer_render_checkerboard */
+	void (*damage_render_func)(struct base_buffer *buffer, const struct base_rect *buffer_damage,
+		struct base_rect *damage);
+	/* Used by render_frame(), created on demand */
+	struct base_swapchain *swapchain;
+	/* Created on demand to crop buffers which are larger than their content */
+	struct wp_viewport *viewport;
+	bool cropped;
 	struct wl_array callbacks;
 };
 
@@ -1,10 +1,22 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <wayland-util.h>
 #include <drm/drm_fourcc.h>
 
-#define AVAILABLE_DROP_THRESHOLD 4
+#define BASE_BUFFER_MAX_PLANES 4
+#define BASE_BUFFER_INLINE_ATTACHMENTS 4
+#define BASE_BUFFER_DAMAGE_HISTORY 4
+#define BASE_BUFFER_POOL_DEFAULT_MAX_IDLE 3
+#define BASE_BUFFER_POOL_DEFAULT_MAX_SLACK_PERCENT 50
+/* Row alignment of buffers only touched by the CPU, covers AVX-512 stores and cache lines */
+#define BASE_BUFFER_POOL_DEFAULT_STRIDE_ALIGN 64
+/* Row alignment of buffers for SCANOUT or RENDERING, the common pitch requirement of GPU imports */
+#define BASE_BUFFER_POOL_DEFAULT_GPU_STRIDE_ALIGN 256
+#define BASE_BUFFER_POOL_BUCKETS 64 /* must be a power of 2 */
+#define BASE_BUFFER_POOL_SIZE_CLASSES 32
 
 #ifdef LOG_BUFFERS
 	#include "log.h"
@@ -19,92 +31,564 @@ enum base_allocator_caps {
 	BASE_ALLOCATOR_CAP_EXPORT_SHM    = 1u << 2,
 };
 
+/* Informational, records how the memory behind a buffer was actually allocated */
+enum base_buffer_backing_flags {
+	BASE_BUFFER_BACKING_HUGETLB = 1u << 0,
+	BASE_BUFFER_BACKING_THP     = 1u << 1,
+	BASE_BUFFER_BACKING_SEALED  = 1u << 2,
+	/* CPU mapping is kept across get_pixels() calls rather than mapped per access */
+	BASE_BUFFER_BACKING_PERSISTENT_MAP = 1u << 3,
+};
+
+/*
+ * How a buffer is going to be used, lets allocators pick a suitable memory
+ * type and layout. Buffers are only re-used for requests of the same usage.
+ */
+enum base_buffer_usage_flags {
+	/* Displayed directly by KMS or a compositor plane */
+	BASE_BUFFER_USAGE_SCANOUT   = 1u << 0,
+	/* Render target of the GPU */
+	BASE_BUFFER_USAGE_RENDERING = 1u << 1,
+	/* Filled by the CPU via get_pixels(), e.g. software rendering */
+	BASE_BUFFER_USAGE_CPU_WRITE = 1u << 2,
+	/* Read back by the CPU via get_pixels(), e.g. screen capture */
+	BASE_BUFFER_USAGE_CPU_READ  = 1u << 3,
+	/*
+	 * Hint that the size requested by this consumer keeps changing, e.g. during
+	 * an interactive resize. Allocators which can't reshape their buffers may
+	 * allocate larger ones and crop them, see buffer->alloc_width. Not part of
+	 * buffer->usage and ignored for re-use.
+	 */
+	BASE_BUFFER_USAGE_HINT_RESIZING = 1u << 4,
+};
+
+#define BASE_BUFFER_USAGE_HINTS BASE_BUFFER_USAGE_HINT_RESIZING
+#define BASE_BUFFER_USAGE_CPU (BASE_BUFFER_USAGE_CPU_WRITE | BASE_BUFFER_USAGE_CPU_READ)
+
 enum base_allocator_access_flags {
 	BASE_ALLOCATOR_REQ_READ  = 1u << 0,
 	BASE_ALLOCATOR_REQ_WRITE = 1u << 1,
 	BASE_ALLOCATOR_REQ_RDWR  = (BASE_ALLOCATOR_REQ_READ | BASE_ALLOCATOR_REQ_WRITE),
 };
 
+struct base_rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+/* Grows dst to the bounding box of both rects, empty rects are ignored */
+static inline void
+base_rect_union(struct base_rect *dst, const struct base_rect *src)
+{
+	if (src->width <= 0 || src->height <= 0) {
+		return;
+	}
+	if (dst->width <= 0 || dst->height <= 0) {
+		*dst = *src;
+		return;
+	}
+	const int32_t x2 = dst->x + dst->width > src->x + src->width
+		? dst->x + dst->width : src->x + src->width;
+	const int32_t y2 = dst->y + dst->height > src->y + src->height
+		? dst->y + dst->height : src->y + src->height;
+	dst->x = dst->x < src->x ? dst->x : src->x;
+	dst->y = dst->y < src->y ? dst->y : src->y;
+	dst->width = x2 - dst->x;
+	dst->height = y2 - dst->y;
+}
+
 /*
  * Reference counted buffer abstraction
  *
  * After creation by the allocator the buffer has a ref count of 0.
- * Callers should call buffer->lock(buffer) as soon as they receive
+ * Callers should call buffer->impl->lock(buffer) as soon as they receive
  * the buffer to prevent potential re-use on most allocator backends.
+ * The operations are shared by all buffers of an allocator, so buffers
+ * stay small and the props used by pool scans share a cache line.
  *
- * buffer->unlock(buffer) reduces the ref count and if it reaches 0,
+ * buffer->impl->unlock(buffer) reduces the ref count and if it reaches 0,
  * the buffer might either be destroyed or added back to a pool of
  * available buffers, depending on the allocator backend.
  *
- * When requesting a wl_buffer via buffer->get_wl_buffer(), a lock is
+ * When requesting a wl_buffer via buffer->impl->get_wl_buffer(), a lock is
  * added and will be released automatically when the compositor sends
  * the release event of the wl_buffer.
  *
- * The serial increments each time buffer->get_pixels() with REQ_WRITE
+ * The serial increments each time buffer->impl->get_pixels() with REQ_WRITE
  * is called and can be used by consumers to get notified about changes.
- * An external modification may be marked with buffer->mark_dirty().
+ * An external modification may be marked with buffer->impl->mark_dirty().
+ * Writers knowing which region they changed report it via
+ * buffer->impl->add_damage(), which lets consumers like the staging upload
+ * of the wl_buffer manager copy only that part.
+ *
+ * Threading: buffer->impl->lock() and buffer->impl->unlock() are atomic
+ * and may be called from any thread. Allocators serialize their pools and
+ * devices internally, so create_buffer() and get_pixels() of different
+ * buffers may be called from several threads at once, e.g. by render
+ * workers. Everything else about a buffer (get_pixels(), attachments, the
+ * props) belongs to whichever thread the caller hands it to, like a worker
+ * rendering into it and then passing it to the dispatch thread which calls
+ * get_wl_buffer(), attaches and commits. allocator->destroy() must not
+ * race with any other use of the allocator or its buffers.
  */
 
 struct client;
 struct base_buffer;
+struct base_buffer_pool;
+struct base_shm_slab;
 typedef void (*attachment_destroy_func_t)(struct base_buffer *buffer, void *key, void *value);
-struct base_buffer {
 
+/*
+ * Operations of a buffer, one shared table per allocator implementation.
+ * Allocator independent ones point to the base_buffer_common_*() functions.
+ */
+struct base_buffer_impl {
 	void *(*get_pixels)(struct base_buffer *buffer, enum base_allocator_access_flags access);
 	void (*get_pixels_end)(struct base_buffer *buffer, void *pixels);
 	struct wl_buffer *(*get_wl_buffer)(struct base_buffer *buffer, struct client *client);
 	void (*lock)(struct base_buffer *buffer);
 	void (*unlock)(struct base_buffer *buffer);
 	void (*mark_dirty)(struct base_buffer *buffer);
+	/*
+	 * Narrows down the region changed by the most recent serial, which
+	 * otherwise counts as the full buffer. Call after writing the pixels.
+	 */
+	void (*add_damage)(struct base_buffer *buffer, const struct base_rect *damage);
+	/* Region changed since since_serial, the full buffer if that is unknown */
+	void (*get_damage)(struct base_buffer *buffer, uint32_t since_serial, struct base_rect *damage);
+	/*
+	 * Non-blocking check whether access would have to wait for the
+	 * compositor or GPU to finish with the buffer. get_pixels() waits.
+	 */
+	bool (*is_idle)(struct base_buffer *buffer, enum base_allocator_access_flags access);
 
 	void *(*get_attachment)(struct base_buffer *buffer, void *key);
 	void (*set_attachment)(struct base_buffer *buffer, void *key, void *data, attachment_destroy_func_t destroy_cb);
 
+	/* Internal export helpers */
+	int (*get_fd)(struct base_buffer *buffer);
+	/* Optional, for buffers exporting both. get_fd() returns the dmabuf then */
+	int (*get_shm_fd)(struct base_buffer *buffer);
+	uint32_t (*get_byte_size)(struct base_buffer *buffer);
+	/* Optional, returns the shared SHM backing and the offset of the buffer within it */
+	struct base_shm_slab *(*get_shm_slab)(struct base_buffer *buffer, uint32_t *offset);
+	/*
+	 * Optional, gives the pages of an unlocked buffer back to the kernel while
+	 * keeping the buffer itself. Returns the number of bytes released.
+	 */
+	uint64_t (*release_pages)(struct base_buffer *buffer);
+	/* Pool support */
+	bool (*is_exact_match)(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
+	bool (*is_close_match)(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
+	void (*destroy)(struct base_buffer *buffer);
+	/* Internal helpers */
+	void (*destroy_attachments)(struct base_buffer *buffer);
+	// fences?
+};
+
+struct base_buffer {
+	const struct base_buffer_impl *impl;
+
+	/* Read on every frame and by pool scans, kept within the first cache line */
 	uint32_t width;
 	uint32_t height;
+	/*
+	 * Between get_pixels() and get_pixels_end() the stride of the CPU mapping,
+	 * which differs from the one of the allocation for drivers detiling into
+	 * a staging copy. Don't create attachments while a buffer is mapped.
+	 */
 	uint32_t stride;
 	uint32_t fourcc;
 	uint64_t modifier;
-
-	uint32_t caps;
 	/* Increments each time get_pixels() with REQ_WRITE is called and can be used by consumers to see changes */
 	uint32_t serial;
+	/* Private, see buffer->impl->lock() and buffer->impl->unlock() */
+	atomic_int locks;
+
+	/*
+	 * Dimensions of the underlying allocation. May be larger than width and
+	 * height when a buffer is re-used for a smaller size, only the top left
+	 * width x height region is meant to be presented then.
+	 */
+	uint32_t alloc_width;
+	uint32_t alloc_height;
+	/* Always at least one plane, planes[0].stride equals stride. Planes may share the same fd */
+	uint32_t plane_count;
+	struct base_buffer_plane {
+		int fd;
+		uint32_t offset;
+		uint32_t stride;
+	} planes[BASE_BUFFER_MAX_PLANES];
+	/*
+	 * Every row of every plane returned by get_pixels() starts at a multiple
+	 * of this many bytes, e.g. for aligned SIMD stores. Transient gbm_bo_map()
+	 * mappings (no BASE_BUFFER_BACKING_PERSISTENT_MAP) use their own layout.
+	 */
+	uint32_t stride_align;
+
+	uint32_t caps;
+	/* enum base_buffer_usage_flags, as requested on creation */
+	uint32_t usage;
+	/* enum base_buffer_backing_flags */
+	uint32_t backing;
+	/*
+	 * Number of frames since the contents were presented, 1 being the previous
+	 * frame. 0 if the contents are undefined. Maintained by base_swapchain.
+	 */
+	uint32_t age;
 
 	/* Private */
-	int locks;
 	struct wl_list link;
+	struct {
+		struct base_buffer_pool *owner;
+		/* Unlocked and part of the pool index */
+		bool available;
+		uint64_t released_ms;
+		uint32_t byte_size;
+		uint32_t size_class;
+		struct wl_list available_link;
+		struct wl_list exact_link;
+		struct wl_list size_link;
+	} pool;
+	/* The first BASE_BUFFER_INLINE_ATTACHMENTS live inline, further ones in attachments_overflow */
 	struct attachment {
 		void *key;
 		void *value;
 		attachment_destroy_func_t destroy_cb;
-		struct attachment *next;
-	} *attachments;
+	} attachments[BASE_BUFFER_INLINE_ATTACHMENTS];
+	uint32_t attachment_count;
+	struct wl_array attachments_overflow;
+	/* Changed region per serial, indexed by serial % BASE_BUFFER_DAMAGE_HISTORY */
+	struct base_buffer_damage {
+		uint32_t serial;
+		struct base_rect rect;
+	} damage[BASE_BUFFER_DAMAGE_HISTORY];
+};
 
-	/* Internal export helpers */
-	int (*get_fd)(struct base_buffer *buffer);
-	uint32_t (*get_byte_size)(struct base_buffer *buffer);
-	/* Pool support */
-	bool (*is_exact_match)(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
-	bool (*is_close_match)(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
-	void (*destroy)(struct base_buffer *buffer);
-	/* Internal helpers */
-	void (*destroy_attachments)(struct base_buffer *buffer);
-	// fences?
+/*
+ * Retention of unlocked buffers kept around for re-use
+ *
+ * Limits are applied least recently released buffer first whenever a buffer
+ * is unlocked. A value of 0 disables the respective limit. The idle timeout
+ * requires the event loop to call base_buffer_pools_expire() which client->loop()
+ * does automatically.
+ */
+struct base_buffer_pool_policy {
+	/* Includes locked buffers, only unlocked ones will be destroyed though */
+	uint64_t max_resident_bytes;
+	/* Defaults to BASE_BUFFER_POOL_DEFAULT_MAX_IDLE */
+	uint32_t max_idle;
+	/* Size classes are powers of two of the byte size */
+	uint32_t max_idle_per_size_class;
+	uint32_t idle_timeout_ms;
+	/*
+	 * Maximum percentage of a larger buffer that may stay unused when it
+	 * is re-used for a smaller request, defaults to
+	 * BASE_BUFFER_POOL_DEFAULT_MAX_SLACK_PERCENT. Allocators may give the
+	 * unused tail back to the kernel, the byte size of the buffer stays.
+	 */
+	uint32_t max_slack_percent;
+	/*
+	 * Allocators able to present a cropped region (see base_buffer->alloc_width)
+	 * re-use larger buffers and round up allocations while the requested size
+	 * changes. Set this for consumers which can't crop, e.g. screen capture.
+	 */
+	bool exact_size;
+	/*
+	 * Unlocked buffers kept when trimming the pool under memory pressure,
+	 * see base_buffer_pools_trim(). Their pages are released nevertheless
+	 * if the allocator supports that.
+	 */
+	uint32_t pressure_min_idle;
+	/*
+	 * Row alignment in bytes of allocators choosing the stride themselves,
+	 * for buffers without and with SCANOUT or RENDERING usage. 0 picks
+	 * BASE_BUFFER_POOL_DEFAULT_STRIDE_ALIGN and
+	 * BASE_BUFFER_POOL_DEFAULT_GPU_STRIDE_ALIGN respectively. Idle buffers
+	 * keep the alignment they were created with.
+	 */
+	uint32_t stride_align;
+	uint32_t gpu_stride_align;
+};
+
+struct base_format {
+	uint32_t fourcc;
+	uint64_t modifier;
+};
+
+/*
+ * Buffers to create ahead of time, e.g. right after a configure or mode set
+ *
+ * The first frames otherwise pay for the allocation, page faults and the
+ * import into the compositor or KMS on top of rendering. Reserved buffers
+ * are handed out by later create_buffer() calls with the same parameters.
+ *
+ * A reservation ensures count idle buffers of its kind, idle buffers already
+ * in the pool are counted and only the missing ones are created. Consumers
+ * sharing the allocator reserve once with their combined count.
+ */
+struct base_buffer_reservation {
+	uint32_t count;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc;
+	uint64_t modifier;
+	/* enum base_buffer_usage_flags */
+	uint32_t usage;
+	/*
+	 * Optional, called for each buffer before it goes into the pool, e.g. to
+	 * pre-create its wl_buffer or KMS framebuffer with the prepare_buffer()
+	 * functions of base_wl_buffer_manager and drm.
+	 */
+	void (*prepare)(struct base_buffer *buffer, void *data);
+	void *data;
+
+	/* Set by the background thread of base_allocator_reserve_async() once it is done */
+	atomic_bool done;
+
+	/* Private */
+	struct base_allocator *allocator;
+	pthread_t thread;
+	/* Locked until base_allocator_reserve_finish() */
+	struct base_buffer **buffers;
+	uint32_t reserved;
 };
 
 struct base_allocator {
-	struct base_buffer *(*create_buffer)(struct base_allocator *allocator, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
+	/* usage is enum base_buffer_usage_flags */
+	struct base_buffer *(*create_buffer)(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage);
+	/*
+	 * Candidates in order of preference, e.g. as advertised by the compositor or a KMS plane.
+	 * The allocator may pick any of them, the result is reported in buffer->fourcc and buffer->modifier.
+	 */
+	struct base_buffer *(*create_buffer_from_list)(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		const struct base_format *formats, size_t format_count, uint32_t usage);
+	/*
+	 * Ensures the reserved buffers exist, pre-faults the ones with CPU usage and
+	 * puts them into the pool. Returns the number of buffers ready. The pool keeps at
+	 * most max_idle of them and the idle timeout of the policy still applies.
+	 */
+	uint32_t (*reserve)(struct base_allocator *allocator, const struct base_buffer_reservation *reservation);
+	void (*set_policy)(struct base_allocator *allocator, const struct base_buffer_pool_policy *policy);
 	void (*destroy)(struct base_allocator *allocator);
 	uint32_t capabilities;
+
+	/* Private */
+	struct base_buffer_pool *pool;
+};
+
+struct base_allocator_counters {
+	/* Current state */
+	uint64_t live_buffers;
+	uint64_t resident_bytes;
+
+	/* Events since the allocator was created */
+	uint64_t exact_hits;
+	uint64_t close_hits;
+	/* New buffers, either allocated because the pool had no match or imported */
+	uint64_t misses;
+	/* Unlocked buffers destroyed due to the pool policy or the idle timeout */
+	uint64_t evictions;
+	/* CPU mappings, persistent ones once per buffer, transient ones per get_pixels() */
+	uint64_t maps;
+	uint64_t wl_buffers_created;
+	/* base_swapchain->acquire() calls which found all buffers in use */
+	uint64_t starvations;
+	/* Unlocked buffers destroyed by base_buffer_pools_trim() */
+	uint64_t trimmed_buffers;
+	/* Memory given back by base_buffer_pools_trim(), including the trimmed buffers */
+	uint64_t trimmed_bytes;
+};
+
+/*
+ * Runtime statistics of an allocator, independent of LOG_BUFFERS
+ *
+ * Each counter is also split by size class, floor(log2(byte size)) of the
+ * buffer or for starvations of the buffer the swapchain would have needed.
+ */
+struct base_allocator_stats {
+	struct base_allocator_counters total;
+	struct base_allocator_counters size_classes[BASE_BUFFER_POOL_SIZE_CLASSES];
+};
+
+void base_allocator_get_stats(struct base_allocator *allocator, struct base_allocator_stats *stats);
+
+/*
+ * Creates and pre-faults the reserved buffers on a background thread
+ *
+ * If it returns true, base_allocator_reserve_finish() has to be called before
+ * the allocator is destroyed. It waits for the thread if reservation->done isn't
+ * set yet, runs prepare() on the calling thread and returns the number of
+ * buffers ready. The reservation has to stay alive until then.
+ */
+bool base_allocator_reserve_async(struct base_allocator *allocator, struct base_buffer_reservation *reservation);
+uint32_t base_allocator_reserve_finish(struct base_buffer_reservation *reservation);
+
+/*
+ * Destroys unlocked buffers of all allocators which exceeded their idle timeout
+ *
+ * Returns the time in ms until the next buffer expires or -1 if there is none,
+ * suitable to be used as poll() timeout.
+ */
+int base_buffer_pools_expire(void);
+
+/*
+ * Destroys unlocked buffers of all allocators down to their pressure_min_idle
+ * policy and releases the pages of the remaining ones. Meant to be called on
+ * memory pressure, see base_memory_pressure, which client->loop() does automatically.
+ */
+void base_buffer_pools_trim(void);
+
+/*
+ * Watches for memory pressure of the own cgroup or the whole system
+ *
+ * Uses a PSI trigger on memory.pressure of the own cgroup or on
+ * /proc/pressure/memory and falls back to memory.events of the own cgroup.
+ * Poll pressure->fd for POLLPRI and pass the revents to pressure->dispatch()
+ * once it signals. It returns 1 if memory is under pressure, 0 if not and -1
+ * if monitoring stopped working, e.g. as the cgroup was removed. Destroy the
+ * pressure object then, its fd would signal forever.
+ */
+struct base_memory_pressure {
+	int (*dispatch)(struct base_memory_pressure *pressure, short revents);
+	void (*destroy)(struct base_memory_pressure *pressure);
+	int fd;
+
+	/* Private */
+	/* Only used with memory.events, the sum of its high and max counters */
+	bool is_events_file;
+	uint64_t events;
+};
+struct base_memory_pressure *base_memory_pressure_create(void);
+
+enum shm_allocator_flags {
+	/* Sub-allocate all buffers from a single growing memfd, see struct base_shm_slab */
+	SHM_ALLOCATOR_SLAB = 1u << 0,
+	/*
+	 * Back buffers of at least 2 MiB (or the whole slab) with MFD_HUGETLB,
+	 * falling back to transparent huge pages and then to regular pages.
+	 * The memfds are also sealed with F_SEAL_SHRINK so compositors can
+	 * skip their SIGBUS protection. See base_buffer->backing for the result.
+	 */
+	SHM_ALLOCATOR_HUGEPAGES = 1u << 1,
 };
 
 struct base_allocator *drm_allocator_create(int drm_fd);
 struct base_allocator *gbm_allocator_create(int drm_fd);
 struct base_allocator *shm_allocator_create(void);
+struct base_allocator *shm_allocator_create_with_flags(uint32_t flags);
+/* memfd backed buffers which are exported as SHM and as dmabuf via /dev/udmabuf */
+struct base_allocator *udmabuf_allocator_create(void);
+
+/*
+ * Shared SHM backing of an allocator created with SHM_ALLOCATOR_SLAB
+ *
+ * The memfd only ever grows, so consumers can keep a single wl_shm_pool
+ * per slab and wl_shm_pool_resize() it to slab->size when required.
+ * Per consumer state like that wl_shm_pool can be stored as attachment,
+ * the destroy callback is called when the slab is destroyed together
+ * with its allocator.
+ */
+typedef void (*slab_attachment_destroy_func_t)(struct base_shm_slab *slab, void *key, void *value);
+struct base_shm_slab {
+	int fd;
+	uint32_t size;
+
+	/* Private */
+	struct wl_array attachments;
+};
+void *base_shm_slab_get_attachment(struct base_shm_slab *slab, void *key);
+void base_shm_slab_set_attachment(struct base_shm_slab *slab, void *key, void *value, slab_attachment_destroy_func_t destroy_cb);
 
 struct gbm_bo;
 struct base_buffer *gbm_allocator_wrap_gbm_bo(struct base_allocator *allocator, struct gbm_bo *bo);
 
-/* Internal pool helpers */
-struct base_buffer *base_buffer_pool_get_buffer(struct wl_list *buffers, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier);
-void base_buffer_pool_cleanup(struct wl_list *buffers);
+/*
+ * Internal pool helpers
+ *
+ * Allocators add new buffers with base_buffer_pool_add() and remove them
+ * in buffer->impl->destroy() via base_buffer_pool_remove(). buffer->impl->lock() has
+ * to call base_buffer_pool_acquire() for the first lock and buffer->impl->unlock()
+ * base_buffer_pool_release() once the last lock is gone. Allocators have
+ * to call base_buffer_pool_finish() before freeing the pool.
+ *
+ * All pool functions take the pool mutex. Allocators wrap access to their
+ * own shared state with base_buffer_pool_lock() and base_buffer_pool_unlock(),
+ * the mutex is recursive so pool functions may be called while holding it.
+ */
+struct base_buffer_pool {
+	pthread_mutex_t mutex;
+	struct base_buffer_pool_policy policy;
+	struct wl_list link;
+	/* All buffers of the allocator */
+	struct wl_list buffers;
+	uint32_t total_count;
+	uint64_t resident_bytes;
+	/* Unlocked buffers, least recently released first */
+	struct wl_list available;
+	uint32_t available_count;
+	/* Unlocked buffers by width, height, fourcc, modifier and usage, most recently released first */
+	struct wl_list exact[BASE_BUFFER_POOL_BUCKETS];
+	/* Unlocked buffers by floor(log2(byte size)), most recently released first */
+	struct wl_list size_classes[BASE_BUFFER_POOL_SIZE_CLASSES];
+	uint32_t size_class_counts[BASE_BUFFER_POOL_SIZE_CLASSES];
+	uint32_t size_class_mask;
+	struct base_allocator_stats stats;
+};
+
+void base_buffer_pool_init(struct base_buffer_pool *pool);
+void base_buffer_pool_finish(struct base_buffer_pool *pool);
+void base_buffer_pool_lock(struct base_buffer_pool *pool);
+void base_buffer_pool_unlock(struct base_buffer_pool *pool);
+void base_buffer_pool_set_policy(struct base_buffer_pool *pool, const struct base_buffer_pool_policy *policy);
+/* Row alignment the policy asks for buffers of the given usage */
+uint32_t base_buffer_pool_get_stride_align(struct base_buffer_pool *pool, uint32_t usage);
+void base_buffer_pool_add(struct base_buffer_pool *pool, struct base_buffer *buffer);
+void base_buffer_pool_remove(struct base_buffer_pool *pool, struct base_buffer *buffer);
+void base_buffer_pool_acquire(struct base_buffer_pool *pool, struct base_buffer *buffer);
+void base_buffer_pool_release(struct base_buffer_pool *pool, struct base_buffer *buffer);
+struct base_buffer *base_buffer_pool_get_buffer(struct base_buffer_pool *pool, uint32_t width, uint32_t height,
+	uint32_t fourcc, uint64_t modifier, uint32_t usage);
+void base_buffer_pool_cleanup(struct base_buffer_pool *pool);
+/* Returns the time in ms until the next buffer expires or -1 */
+int base_buffer_pool_expire(struct base_buffer_pool *pool);
+void base_buffer_pool_trim(struct base_buffer_pool *pool);
+/* Statistics of events outside of the pool */
+void base_buffer_pool_count_map(struct base_buffer_pool *pool, struct base_buffer *buffer);
+void base_buffer_pool_count_wl_buffer(struct base_buffer *buffer);
+void base_buffer_pool_count_starvation(struct base_buffer_pool *pool, uint32_t byte_size);
+
+/*
+ * Internal dmabuf helpers, access is enum base_allocator_access_flags
+ *
+ * Allocators bracket CPU access to dmabuf backed buffers with
+ * base_dmabuf_begin_cpu_access() and base_dmabuf_end_cpu_access().
+ */
+bool base_dmabuf_begin_cpu_access(int fd, uint32_t access);
+void base_dmabuf_end_cpu_access(int fd, uint32_t access);
+bool base_dmabuf_is_idle(int fd, uint32_t access);
+
+/*
+ * Shared parts of the allocator implementations
+ *
+ * base_buffer_common_init() fills in defaults of new buffers, the
+ * base_buffer_common_*() operations are meant for their impl tables.
+ */
+void base_buffer_common_init(struct base_buffer *buffer);
+struct wl_buffer *base_buffer_common_get_wl_buffer(struct base_buffer *buffer, struct client *client);
+void base_buffer_common_mark_dirty(struct base_buffer *buffer);
+void base_buffer_common_add_damage(struct base_buffer *buffer, const struct base_rect *damage);
+void base_buffer_common_get_damage(struct base_buffer *buffer, uint32_t since_serial, struct base_rect *damage);
+/* Only checks dmabuf backed buffers, others are always idle */
+bool base_buffer_common_is_idle(struct base_buffer *buffer, enum base_allocator_access_flags access);
+void *base_buffer_common_get_attachment(struct base_buffer *buffer, void *key);
+void base_buffer_common_set_attachment(struct base_buffer *buffer, void *key, void *value,
+	attachment_destroy_func_t destroy_cb);
+void base_buffer_common_destroy_attachments(struct base_buffer *buffer);
+struct base_buffer *base_allocator_common_create_buffer_from_list(struct base_allocator *allocator,
+	uint32_t width, uint32_t height, const struct base_format *formats, size_t format_count, uint32_t usage);
+uint32_t base_allocator_common_reserve(struct base_allocator *allocator,
+	const struct base_buffer_reservation *reservation);
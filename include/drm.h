@@ -26,6 +26,7 @@ struct drm_output {
 	struct drm_output_mode *mode;
 	void *data;
 	bool (*set_mode)(struct drm_output *output, struct drm_output_mode *mode, struct base_buffer *buffer);
+	/* Buffers stay locked by the output until they are replaced on screen */
 	bool (*set_buffer)(struct drm_output *output, struct base_buffer *buffer, bool block);
 
 	// FIXME: Move over to usual callback infrastructure
@@ -33,6 +34,15 @@ struct drm_output {
 
 	/* Private */
 	uint32_t requested_pageflip_fb_id;
+	/* Waiting for the page flip of pending_buffer to be committed */
+	struct base_buffer *queued_buffer;
+	/* Committed, waiting for the page flip */
+	struct base_buffer *pending_buffer;
+	/* On screen */
+	struct base_buffer *current_buffer;
+	/* Currently committed SRC_W / SRC_H, in pixels */
+	uint32_t src_width;
+	uint32_t src_height;
 	uint32_t connector_id;
 	uint32_t encoder_id;
 	uint32_t crtc_id;
@@ -65,6 +75,8 @@ struct drm {
 	struct wl_list outputs;
 
 	bool (*read_events)(struct drm *drm, bool block);
+	/* Imports the buffer as KMS framebuffer ahead of time, see base_buffer_reservation */
+	bool (*prepare_buffer)(struct drm *drm, struct base_buffer *buffer);
 	void (*destroy)(struct drm *drm);
 };
 
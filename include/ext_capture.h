@@ -1,11 +1,7 @@
 #pragma once
 
 #include <wayland-util.h>
-
-struct ext_capture_dmabuf_format {
-	uint32_t fourcc;
-	uint64_t modifier;
-};
+#include "buffer.h"
 
 struct client;
 struct base_buffer;
@@ -29,6 +25,7 @@ struct ext_capture_session {
 		struct wl_array formats;
 	} shm;
 	struct {
+		/* struct base_format, in compositor preference order */
 		struct wl_array formats;
 	} drm;
 	void *data;
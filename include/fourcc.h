@@ -4,62 +4,245 @@
 #include <GLES2/gl2.h>
 #include <wayland-client-protocol.h>
 
-#define format_for_each(var, formats) for(const struct fourcc_details *(var) = (formats); (var)->fourcc != DRM_FORMAT_INVALID; (var)++)
+#define FOURCC_MAX_PLANES 4
 
-static const struct fourcc_details {
-	uint32_t bytes_per_pixel;
+#define FOURCC_DIV_ROUND_UP(x, y) (((x) + (y) - 1) / (y))
+#define FOURCC_ALIGN(x, a) (FOURCC_DIV_ROUND_UP(x, a) * (a))
+
+enum fourcc_flags {
+	FOURCC_HAS_ALPHA = 1u << 0,
+	FOURCC_IS_YUV    = 1u << 1,
+	FOURCC_IS_FLOAT  = 1u << 2,
+};
+
+/* Shorthands for the table below, undefined again after it */
+#define FOURCC_X_ALPHA FOURCC_HAS_ALPHA
+#define FOURCC_X_YUV FOURCC_IS_YUV
+#define FOURCC_X_FLOAT FOURCC_IS_FLOAT
+#define FOURCC_X_NO_GL 0, 0, 0
+
+/*
+ * Bytes per block of each plane, a block covers block_width pixels of a row.
+ * Additional planes are subsampled by hsub and vsub, unused planes are 0.
+ */
+#define FOURCC_FORMATS(X) \
+	/* name           block sizes   width hsub vsub flags                             gl internal, format, component type */ \
+	X(XRGB8888,       4, 0, 0,      1,    1,   1,   0,                                GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE) \
+	X(ARGB8888,       4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE) \
+	X(ABGR8888,       4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE) /* FIXME: verify gl */ \
+	X(XBGR8888,       4, 0, 0,      1,    1,   1,   0,                                GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE) /* FIXME: verify gl */ \
+	X(RGBX8888,       4, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(RGBA8888,       4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(BGRX8888,       4, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(BGRA8888,       4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(RGB888,         3, 0, 0,      1,    1,   1,   0,                                GL_RGB,  GL_RGB,  GL_UNSIGNED_BYTE) \
+	X(BGR888,         3, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(RGB565,         2, 0, 0,      1,    1,   1,   0,                                GL_RGB,  GL_RGB,  GL_UNSIGNED_SHORT_5_6_5) \
+	X(BGR565,         2, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(XRGB1555,       2, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ARGB1555,       2, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(XRGB4444,       2, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ARGB4444,       2, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(R8,             1, 0, 0,      1,    1,   1,   0,                                GL_LUMINANCE, GL_LUMINANCE, GL_UNSIGNED_BYTE) \
+	X(R16,            2, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(GR88,           2, 0, 0,      1,    1,   1,   0,                                GL_LUMINANCE_ALPHA, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE) \
+	X(GR1616,         4, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	/* 10 bit per channel */ \
+	X(XRGB2101010,    4, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ARGB2101010,    4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(XBGR2101010,    4, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ABGR2101010,    4, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	/* 16 bit per channel, integer and half float */ \
+	X(XRGB16161616,   8, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ARGB16161616,   8, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(XBGR16161616,   8, 0, 0,      1,    1,   1,   0,                                FOURCC_X_NO_GL) \
+	X(ABGR16161616,   8, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA,                   FOURCC_X_NO_GL) \
+	X(XRGB16161616F,  8, 0, 0,      1,    1,   1,   FOURCC_X_FLOAT,                   FOURCC_X_NO_GL) \
+	X(ARGB16161616F,  8, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA | FOURCC_X_FLOAT,  FOURCC_X_NO_GL) \
+	X(XBGR16161616F,  8, 0, 0,      1,    1,   1,   FOURCC_X_FLOAT,                   FOURCC_X_NO_GL) \
+	X(ABGR16161616F,  8, 0, 0,      1,    1,   1,   FOURCC_X_ALPHA | FOURCC_X_FLOAT,  FOURCC_X_NO_GL) \
+	/* YUV has no GL equivalent, it is converted by the compositor or display engine */ \
+	X(YUYV,           4, 0, 0,      2,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YVYU,           4, 0, 0,      2,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(UYVY,           4, 0, 0,      2,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(VYUY,           4, 0, 0,      2,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(AYUV,           4, 0, 0,      1,    1,   1,   FOURCC_X_YUV | FOURCC_X_ALPHA,    FOURCC_X_NO_GL) \
+	X(XYUV8888,       4, 0, 0,      1,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV12,           1, 2, 0,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV21,           1, 2, 0,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV16,           1, 2, 0,      1,    2,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV61,           1, 2, 0,      1,    2,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV24,           1, 2, 0,      1,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(NV42,           1, 2, 0,      1,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(P010,           2, 4, 0,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(P012,           2, 4, 0,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(P016,           2, 4, 0,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(P210,           2, 4, 0,      1,    2,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YUV420,         1, 1, 1,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YVU420,         1, 1, 1,      1,    2,   2,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YUV422,         1, 1, 1,      1,    2,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YVU422,         1, 1, 1,      1,    2,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YUV444,         1, 1, 1,      1,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL) \
+	X(YVU444,         1, 1, 1,      1,    1,   1,   FOURCC_X_YUV,                     FOURCC_X_NO_GL)
+
+struct fourcc_details {
 	uint32_t fourcc;
+	uint8_t block_size[FOURCC_MAX_PLANES];
+	uint8_t block_width;
+	uint8_t plane_count;
+	uint8_t hsub;
+	uint8_t vsub;
+	/* enum fourcc_flags */
+	uint32_t flags;
 	struct {
 		uint32_t internal;
 		uint32_t format;
 		uint32_t component_type;
 	} gl_fmt;
-} formats[] = {
-	{ 4, DRM_FORMAT_XRGB8888, { GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE } },
-	{ 4, DRM_FORMAT_ARGB8888, { GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE } },
-	{ 4, DRM_FORMAT_ABGR8888, { GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE } }, /* FIXME: verify gl */
-	{ 4, DRM_FORMAT_XBGR8888, { GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE } }, /* FIXME: verify gl */
-	{ 3, DRM_FORMAT_RGB888,   { GL_RGB,  GL_RGB,  GL_UNSIGNED_BYTE } },
-	{ 2, DRM_FORMAT_RGB565,   { GL_RGB,  GL_RGB,  GL_UNSIGNED_SHORT_5_6_5 } },
-	/* sentinel */
-	{ 0, DRM_FORMAT_INVALID }
 };
 
+enum fourcc_index {
+#define FOURCC_INDEX(name, ...) FOURCC_INDEX_##name,
+	FOURCC_FORMATS(FOURCC_INDEX)
+#undef FOURCC_INDEX
+	FOURCC_INDEX_COUNT
+};
+
+static const struct fourcc_details fourcc_table[FOURCC_INDEX_COUNT] = {
+#define FOURCC_DETAILS(name, b0, b1, b2, bw, hs, vs, fl, ...) \
+	[FOURCC_INDEX_##name] = { \
+		.fourcc = DRM_FORMAT_##name, \
+		.block_size = { b0, b1, b2 }, \
+		.block_width = bw, \
+		.plane_count = 1 + !!(b1) + !!(b2), \
+		.hsub = hs, \
+		.vsub = vs, \
+		.flags = fl, \
+		.gl_fmt = { __VA_ARGS__ }, \
+	},
+	FOURCC_FORMATS(FOURCC_DETAILS)
+#undef FOURCC_DETAILS
+};
+
+#undef FOURCC_X_ALPHA
+#undef FOURCC_X_YUV
+#undef FOURCC_X_FLOAT
+#undef FOURCC_X_NO_GL
 
+/*
+ * Constant time, a switch over the fourcc codes. For constant fourccs
+ * the compiler resolves this and the helpers below at compile time.
+ */
+static inline const struct fourcc_details *
+fourcc_get_details(uint32_t fourcc)
+{
+	switch (fourcc) {
+#define FOURCC_CASE(name, ...) case DRM_FORMAT_##name: return &fourcc_table[FOURCC_INDEX_##name];
+	FOURCC_FORMATS(FOURCC_CASE)
+#undef FOURCC_CASE
+	default:
+		return NULL;
+	}
+}
+
+/* Of the first plane */
 static inline uint32_t
 fourcc_get_stride(uint32_t fourcc, uint32_t width)
 {
-	format_for_each(format, formats) {
-		if (format->fourcc == fourcc) {
-			return format->bytes_per_pixel * width;
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	return format ? format->block_size[0] * FOURCC_DIV_ROUND_UP(width, format->block_width) : 0;
+}
+
+/* Of the first plane, rounded up to a multiple of align bytes */
+static inline uint32_t
+fourcc_get_aligned_stride(uint32_t fourcc, uint32_t width, uint32_t align)
+{
+	return FOURCC_ALIGN(fourcc_get_stride(fourcc, width), align);
+}
+
+static inline uint32_t
+fourcc_get_plane_count(uint32_t fourcc)
+{
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	return format ? format->plane_count : 0;
+}
+
+static inline bool
+fourcc_has_alpha(uint32_t fourcc)
+{
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	return format && (format->flags & FOURCC_HAS_ALPHA);
+}
+
+static inline bool
+fourcc_is_yuv(uint32_t fourcc)
+{
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	return format && (format->flags & FOURCC_IS_YUV);
+}
+
+/*
+ * Layout with all planes following each other and the stride of each plane
+ * rounded up to a multiple of align bytes, so every row starts aligned if the
+ * first one does. Returns the total byte size or 0 for unknown formats.
+ * strides and offsets may be NULL.
+ */
+static inline uint32_t
+fourcc_get_aligned_plane_layout(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t align,
+		uint32_t strides[FOURCC_MAX_PLANES], uint32_t offsets[FOURCC_MAX_PLANES])
+{
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	if (!format) {
+		return 0;
+	}
+	uint32_t stride = FOURCC_ALIGN(format->block_size[0] * FOURCC_DIV_ROUND_UP(width, format->block_width), align);
+	uint32_t size = stride * height;
+	if (strides) {
+		strides[0] = stride;
+	}
+	if (offsets) {
+		offsets[0] = 0;
+	}
+	for (uint32_t i = 1; i < format->plane_count; i++) {
+		stride = FOURCC_ALIGN(format->block_size[i] * FOURCC_DIV_ROUND_UP(width, format->hsub), align);
+		if (strides) {
+			strides[i] = stride;
 		}
+		if (offsets) {
+			offsets[i] = size;
+		}
+		size += stride * FOURCC_DIV_ROUND_UP(height, format->vsub);
 	}
-	return 0;
+	return size;
 }
 
+/* Tightly packed layout, see fourcc_get_aligned_plane_layout() */
+static inline uint32_t
+fourcc_get_plane_layout(uint32_t fourcc, uint32_t width, uint32_t height,
+		uint32_t strides[FOURCC_MAX_PLANES], uint32_t offsets[FOURCC_MAX_PLANES])
+{
+	return fourcc_get_aligned_plane_layout(fourcc, width, height, 1, strides, offsets);
+}
+
+/* Of the first plane, for packed YUV formats like YUYV the average over a block */
 static inline uint32_t
 fourcc_get_bytes_per_pixel(uint32_t fourcc)
 {
-	format_for_each(format, formats) {
-		if (format->fourcc == fourcc) {
-			return format->bytes_per_pixel;
-		}
-	}
-	return 0;
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	return format ? format->block_size[0] / format->block_width : 0;
 }
 
 static inline bool
 fourcc_to_gl_format(uint32_t fourcc, uint32_t *gl_internal, uint32_t *gl_format, uint32_t *gl_component_type)
 {
-	format_for_each(format, formats) {
-		if (format->fourcc == fourcc) {
-			*gl_internal = format->gl_fmt.internal;
-			*gl_format = format->gl_fmt.format;
-			*gl_component_type = format->gl_fmt.component_type;
-			return true;
-		}
+	const struct fourcc_details *format = fourcc_get_details(fourcc);
+	if (!format || !format->gl_fmt.internal) {
+		return false;
 	}
-	return false;
+	*gl_internal = format->gl_fmt.internal;
+	*gl_format = format->gl_fmt.format;
+	*gl_component_type = format->gl_fmt.component_type;
+	return true;
 }
 
 static inline uint32_t
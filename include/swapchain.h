@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+#define BASE_SWAPCHAIN_MAX_DEPTH 4
+#define BASE_SWAPCHAIN_DEFAULT_DEPTH 3
+
+/*
+ * Fixed size ring of buffers on top of a base_allocator
+ *
+ * swapchain->acquire() returns a buffer to render into, or NULL if all
+ * buffers are still in use by the consumer. After rendering, hand the buffer
+ * to the consumer (e.g. surface->set_buffer() or drm_output->set_buffer(),
+ * both lock it until it is replaced) and call swapchain->present().
+ *
+ * Buffers are allocated on demand up to the depth of the swapchain. After
+ * swapchain->resize(), buffers of the old size are dropped as soon as the
+ * consumer releases them.
+ *
+ * For incremental rendering, only swapchain->get_damage() plus whatever
+ * changes in the new frame has to be repainted.
+ *
+ * A swapchain is not thread safe, give each render thread its own. Once
+ * all buffers exist, acquire() only checks their atomic lock counts and
+ * doesn't touch the mutex of the allocator pool.
+ */
+struct base_swapchain {
+	/* Sets buffer->age */
+	struct base_buffer *(*acquire)(struct base_swapchain *swapchain);
+	/*
+	 * Region of the acquired buffer which is outdated compared to the
+	 * previous frame, the full buffer if its age is 0 or too old.
+	 */
+	void (*get_damage)(struct base_swapchain *swapchain, struct base_buffer *buffer, struct base_rect *damage);
+	/* damage is the region changed compared to the previous frame, NULL for the full buffer */
+	void (*present)(struct base_swapchain *swapchain, struct base_buffer *buffer, const struct base_rect *damage);
+	void (*resize)(struct base_swapchain *swapchain, uint32_t width, uint32_t height);
+	void (*destroy)(struct base_swapchain *swapchain);
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc;
+	uint64_t modifier;
+	/* enum base_buffer_usage_flags */
+	uint32_t usage;
+	uint32_t depth;
+	/* Number of acquire() calls which found all buffers in use by the consumer */
+	uint32_t starved_count;
+
+	/* Private */
+	struct base_allocator *allocator;
+	/* Increments on each present() */
+	uint64_t frame;
+	/*
+	 * Set by resize() after the first frame and cleared once two frames in a
+	 * row were presented at the same size, see BASE_BUFFER_USAGE_HINT_RESIZING.
+	 */
+	bool resizing;
+	uint32_t presented_width;
+	uint32_t presented_height;
+	/* Damage of the most recent frames, indexed by frame % BASE_SWAPCHAIN_MAX_DEPTH */
+	struct base_rect damage[BASE_SWAPCHAIN_MAX_DEPTH];
+	struct base_swapchain_slot {
+		/* Locked by the swapchain for as long as it is part of it */
+		struct base_buffer *buffer;
+		/* Between acquire() and present() */
+		bool acquired;
+		/* Value of frame when the buffer was presented the last time */
+		uint64_t presented;
+	} slots[BASE_SWAPCHAIN_MAX_DEPTH];
+};
+
+struct base_swapchain *base_swapchain_create(struct base_allocator *allocator, uint32_t depth,
+	uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier, uint32_t usage);
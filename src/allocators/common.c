@@ -1,88 +1,338 @@
 #include <assert.h>
+#include <errno.h>
+#include <linux/dma-buf.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 #include "base.h"
 #include "buffer.h"
+#include "fourcc.h"
+#include "log.h"
 
-static void *
-base_buffer_common_get_attachment(struct base_buffer *buffer, void *key)
+static struct attachment *
+find_attachment(struct base_buffer *buffer, void *key)
 {
-	for (struct attachment *att = buffer->attachments; att; att = att->next) {
+	const uint32_t inline_count = buffer->attachment_count < BASE_BUFFER_INLINE_ATTACHMENTS
+		? buffer->attachment_count : BASE_BUFFER_INLINE_ATTACHMENTS;
+	for (uint32_t i = 0; i < inline_count; i++) {
+		if (buffer->attachments[i].key == key) {
+			return &buffer->attachments[i];
+		}
+	}
+	struct attachment *att;
+	wl_array_for_each(att, &buffer->attachments_overflow) {
 		if (att->key == key) {
-			return att->value;
+			return att;
 		}
 	}
 	return NULL;
 }
 
-static void
+void *
+base_buffer_common_get_attachment(struct base_buffer *buffer, void *key)
+{
+	struct attachment *att = find_attachment(buffer, key);
+	return att ? att->value : NULL;
+}
+
+void
 base_buffer_common_set_attachment(struct base_buffer *buffer, void *key, void *value, attachment_destroy_func_t destroy_cb)
 {
-	struct attachment *att;
-	for (att = buffer->attachments; att; att = att->next) {
-		if (att->key == key) {
-			att->value = value;
-			att->destroy_cb = destroy_cb;
-			return;
+	struct attachment *att = find_attachment(buffer, key);
+	if (!att) {
+		if (buffer->attachment_count < BASE_BUFFER_INLINE_ATTACHMENTS) {
+			att = &buffer->attachments[buffer->attachment_count];
+		} else {
+			att = wl_array_add(&buffer->attachments_overflow, sizeof(*att));
+			assert(att);
 		}
+		buffer->attachment_count++;
 	}
-	att = calloc(1, sizeof(*att));
-	assert(att);
 	*att = (struct attachment) {
 		.key = key,
 		.value = value,
 		.destroy_cb = destroy_cb,
 	};
-	if (!buffer->attachments) {
-		buffer->attachments = att;
+}
+
+void
+base_buffer_common_destroy_attachments(struct base_buffer *buffer)
+{
+	if (buffer->attachment_count) {
+		BUFFER_LOG(true, buffer, "Destroying attachments");
+	}
+	/* Most recently added first, each entry is removed before its callback runs */
+	while (buffer->attachment_count) {
+		struct attachment att;
+		if (buffer->attachment_count > BASE_BUFFER_INLINE_ATTACHMENTS) {
+			struct wl_array *overflow = &buffer->attachments_overflow;
+			overflow->size -= sizeof(att);
+			att = *(struct attachment *)((char *)overflow->data + overflow->size);
+		} else {
+			att = buffer->attachments[buffer->attachment_count - 1];
+		}
+		buffer->attachment_count--;
+		if (att.destroy_cb) {
+			att.destroy_cb(buffer, att.key, att.value);
+		}
+	}
+	wl_array_release(&buffer->attachments_overflow);
+	wl_array_init(&buffer->attachments_overflow);
+}
+
+struct wl_buffer *
+base_buffer_common_get_wl_buffer(struct base_buffer *buffer, struct client *client)
+{
+	struct base_wl_buffer_manager *manager = client->buffer_manager;
+	return manager->create_wl_buffer(manager, buffer);
+}
+
+void
+base_buffer_common_mark_dirty(struct base_buffer *buffer)
+{
+	buffer->serial++;
+}
+
+void
+base_buffer_common_add_damage(struct base_buffer *buffer, const struct base_rect *damage)
+{
+	/* The first report replaces the full buffer assumed for a new serial */
+	struct base_buffer_damage *entry = &buffer->damage[buffer->serial % BASE_BUFFER_DAMAGE_HISTORY];
+	if (entry->serial != buffer->serial) {
+		entry->serial = buffer->serial;
+		entry->rect = (struct base_rect) { 0 };
+	}
+	base_rect_union(&entry->rect, damage);
+}
+
+void
+base_buffer_common_get_damage(struct base_buffer *buffer, uint32_t since_serial, struct base_rect *damage)
+{
+	const struct base_rect full = { 0, 0, buffer->width, buffer->height };
+	const uint32_t missed = buffer->serial - since_serial;
+	if (missed > BASE_BUFFER_DAMAGE_HISTORY) {
+		*damage = full;
+		return;
+	}
+	*damage = (struct base_rect) { 0 };
+	for (uint32_t i = 0; i < missed; i++) {
+		const uint32_t serial = buffer->serial - i;
+		const struct base_buffer_damage *entry = &buffer->damage[serial % BASE_BUFFER_DAMAGE_HISTORY];
+		if (entry->serial != serial) {
+			/* Written without reporting the damage */
+			*damage = full;
+			return;
+		}
+		base_rect_union(damage, &entry->rect);
+	}
+}
+
+static uint64_t
+dmabuf_sync_flags(uint32_t access)
+{
+	uint64_t flags = 0;
+	if (access & BASE_ALLOCATOR_REQ_READ) {
+		flags |= DMA_BUF_SYNC_READ;
+	}
+	if (access & BASE_ALLOCATOR_REQ_WRITE) {
+		flags |= DMA_BUF_SYNC_WRITE;
+	}
+	return flags;
+}
+
+static bool
+dmabuf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+	while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			perror("Failed to sync dmabuf");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+base_dmabuf_begin_cpu_access(int fd, uint32_t access)
+{
+	/* Blocks until all fences relevant for access have signaled */
+	return dmabuf_sync(fd, DMA_BUF_SYNC_START | dmabuf_sync_flags(access));
+}
+
+void
+base_dmabuf_end_cpu_access(int fd, uint32_t access)
+{
+	dmabuf_sync(fd, DMA_BUF_SYNC_END | dmabuf_sync_flags(access));
+}
+
+bool
+base_dmabuf_is_idle(int fd, uint32_t access)
+{
+	/* Writing has to wait for readers as well, reading only for writers */
+	const bool write = access & BASE_ALLOCATOR_REQ_WRITE;
+	struct dma_buf_export_sync_file export = {
+		.flags = write ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ,
+		.fd = -1,
+	};
+	struct pollfd pfd;
+	if (ioctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export) == 0) {
+		pfd = (struct pollfd) { .fd = export.fd, .events = POLLIN };
 	} else {
-		struct attachment *a;
-		for (a = buffer->attachments; a->next; a = a->next);
-		a->next = att;
+		/* Kernels before 6.0, poll the dmabuf itself */
+		pfd = (struct pollfd) { .fd = fd, .events = write ? POLLOUT : POLLIN };
 	}
+	int ret;
+	do {
+		ret = poll(&pfd, 1, /*timeout*/ 0);
+	} while (ret < 0 && errno == EINTR);
+	if (export.fd >= 0) {
+		close(export.fd);
+	}
+	/* Don't let errors make buffers unusable */
+	return ret != 0;
 }
 
-static void
-_destroy_attachment(struct base_buffer *buffer, struct attachment *att)
+bool
+base_buffer_common_is_idle(struct base_buffer *buffer, enum base_allocator_access_flags access)
 {
-	if (att->next) {
-		_destroy_attachment(buffer, att->next);
+	if (!(buffer->caps & BASE_ALLOCATOR_CAP_EXPORT_DMABUF)) {
+		return true;
 	}
-	if (att->destroy_cb) {
-		att->destroy_cb(buffer, att->key, att->value);
+	return base_dmabuf_is_idle(buffer->planes[0].fd, access);
+}
+
+struct base_buffer *
+base_allocator_common_create_buffer_from_list(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		const struct base_format *formats, size_t format_count, uint32_t usage)
+{
+	/* For allocators without modifier support, use the first linear format we know about */
+	for (size_t i = 0; i < format_count; i++) {
+		if (formats[i].modifier == DRM_FORMAT_MOD_LINEAR && fourcc_get_bytes_per_pixel(formats[i].fourcc)) {
+			return allocator->create_buffer(allocator, width, height,
+				formats[i].fourcc, formats[i].modifier, usage);
+		}
 	}
-	free(att);
+	log("No supported linear format found in list of %zu formats", format_count);
+	return NULL;
 }
 
+/* Creates and pre-faults the buffers, they stay locked by the reservation */
+static uint32_t
+reserve_buffers(struct base_allocator *allocator, const struct base_buffer_reservation *reservation,
+		struct base_buffer ***buffers)
+{
+	base_buffer_pool_lock(allocator->pool);
+	const uint32_t max_idle = allocator->pool->policy.max_idle;
+	base_buffer_pool_unlock(allocator->pool);
+	uint32_t count = reservation->count;
+	if (max_idle && count > max_idle) {
+		log("Reserving %u buffers exceeds the max_idle policy, only %u are kept", count, max_idle);
+		count = max_idle;
+	}
+
+	/* Holding all of them prevents create_buffer() from handing out the same pool buffer twice */
+	*buffers = calloc(count ? count : 1, sizeof(**buffers));
+	assert(*buffers);
+	uint32_t reserved = 0;
+	for (; reserved < count; reserved++) {
+		struct base_buffer *buffer = allocator->create_buffer(allocator, reservation->width,
+			reservation->height, reservation->fourcc, reservation->modifier, reservation->usage);
+		if (!buffer) {
+			log("Failed to reserve buffer %u of %u", reserved + 1, count);
+			break;
+		}
+		buffer->impl->lock(buffer);
+		(*buffers)[reserved] = buffer;
+
+		/*
+		 * Allocators pick MAP_POPULATE from buffer->usage on the first
+		 * get_pixels(), a read access doesn't bump the serial
+		 */
+		if (reservation->usage & BASE_BUFFER_USAGE_CPU) {
+			void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_READ);
+			if (pixels) {
+				buffer->impl->get_pixels_end(buffer, pixels);
+			}
+		}
+	}
+	return reserved;
+}
+
+/* Runs prepare() and hands the buffers over to the pool */
 static void
-base_buffer_common_destroy_attachments(struct base_buffer *buffer)
+release_buffers(const struct base_buffer_reservation *reservation, struct base_buffer **buffers, uint32_t count)
 {
-	if (buffer->attachments) {
-		BUFFER_LOG(true, buffer, "Destroying attachments");
-		_destroy_attachment(buffer, buffer->attachments);
+	for (uint32_t i = 0; i < count; i++) {
+		if (reservation->prepare) {
+			reservation->prepare(buffers[i], reservation->data);
+		}
+		buffers[i]->impl->unlock(buffers[i]);
 	}
-	buffer->attachments = NULL;
+	free(buffers);
 }
 
-static struct wl_buffer *
-base_buffer_common_get_wl_buffer(struct base_buffer *buffer, struct client *client)
+uint32_t
+base_allocator_common_reserve(struct base_allocator *allocator, const struct base_buffer_reservation *reservation)
 {
-	struct base_wl_buffer_manager *manager = client->buffer_manager;
-	return manager->create_wl_buffer(manager, buffer);
+	struct base_buffer **buffers;
+	const uint32_t reserved = reserve_buffers(allocator, reservation, &buffers);
+	release_buffers(reservation, buffers, reserved);
+	return reserved;
 }
 
-static void
-base_buffer_common_mark_dirty(struct base_buffer *buffer)
+static void *
+reserve_thread(void *data)
 {
-	buffer->serial++;
+	struct base_buffer_reservation *reservation = data;
+	reservation->reserved = reserve_buffers(reservation->allocator, reservation, &reservation->buffers);
+	atomic_store(&reservation->done, true);
+	return NULL;
+}
+
+bool
+base_allocator_reserve_async(struct base_allocator *allocator, struct base_buffer_reservation *reservation)
+{
+	reservation->allocator = allocator;
+	reservation->buffers = NULL;
+	reservation->reserved = 0;
+	atomic_store(&reservation->done, false);
+	const int ret = pthread_create(&reservation->thread, NULL, reserve_thread, reservation);
+	if (ret) {
+		errno = ret;
+		perror("Failed to start reservation thread");
+		return false;
+	}
+	return true;
+}
+
+uint32_t
+base_allocator_reserve_finish(struct base_buffer_reservation *reservation)
+{
+	pthread_join(reservation->thread, NULL);
+	release_buffers(reservation, reservation->buffers, reservation->reserved);
+	reservation->buffers = NULL;
+	return reservation->reserved;
 }
 
 void
 base_buffer_common_init(struct base_buffer *buffer)
 {
-	buffer->get_wl_buffer = base_buffer_common_get_wl_buffer;
-	buffer->get_attachment = base_buffer_common_get_attachment;
-	buffer->set_attachment = base_buffer_common_set_attachment;
-	buffer->mark_dirty = base_buffer_common_mark_dirty;
-	buffer->destroy_attachments = base_buffer_common_destroy_attachments;
+	if (!buffer->alloc_width || !buffer->alloc_height) {
+		buffer->alloc_width = buffer->width;
+		buffer->alloc_height = buffer->height;
+	}
+	if (!buffer->stride_align) {
+		/* Strides picked by the driver, mappings are at least page aligned */
+		uint32_t align = 4096;
+		for (uint32_t i = 0; i < buffer->plane_count; i++) {
+			const uint32_t bits = buffer->planes[i].stride | buffer->planes[i].offset;
+			if (bits && (bits & -bits) < align) {
+				align = bits & -bits;
+			}
+		}
+		buffer->stride_align = align;
+	}
 }
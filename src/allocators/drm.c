@@ -0,0 +1,313 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-util.h>
+#include <xf86drm.h>
+
+#include "base.h"
+#include "buffer.h"
+#include "fourcc.h"
+#include "log.h"
+
+struct drm_dumb_allocator {
+	struct base_allocator base;
+	int drm_fd;
+	struct base_buffer_pool pool;
+};
+
+struct drm_dumb_allocator_buffer {
+	struct base_buffer base;
+
+	/* PRIME export of the dumb buffer handle */
+	int fd;
+	uint32_t handle;
+	uint32_t byte_size;
+	struct drm_dumb_allocator *allocator;
+	/*
+	 * Persistent mapping of the buffer, created on the first
+	 * get_pixels() call and kept until the buffer is destroyed.
+	 */
+	void *data;
+	/* Access of the current get_pixels(), for DMA_BUF_IOCTL_SYNC */
+	uint32_t cpu_access;
+};
+
+static void
+dumb_destroy(int drm_fd, uint32_t handle)
+{
+	struct drm_mode_destroy_dumb destroy = { .handle = handle };
+	if (drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy) < 0) {
+		perror("Failed to destroy dumb buffer");
+	}
+}
+
+static void *
+buffer_get_pixels(struct base_buffer *buffer, uint32_t access)
+{
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	if (!dumb_buffer->data) {
+		const int drm_fd = dumb_buffer->allocator->drm_fd;
+		struct drm_mode_map_dumb map = { .handle = dumb_buffer->handle };
+		if (drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+			perror("Failed to prepare dumb buffer for mapping");
+			return NULL;
+		}
+		/* Buffers the CPU is about to fill or read are prefaulted in one go */
+		const int map_flags = buffer->usage & BASE_BUFFER_USAGE_CPU
+			? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+		void *data = mmap(NULL, dumb_buffer->byte_size, PROT_READ | PROT_WRITE,
+			map_flags, drm_fd, map.offset);
+		if (!data || data == MAP_FAILED) {
+			perror("Failed to map dumb buffer");
+			return NULL;
+		}
+		BUFFER_LOG(true, buffer, "Mapped %u bytes", dumb_buffer->byte_size);
+		base_buffer_pool_count_map(&dumb_buffer->allocator->pool, buffer);
+		dumb_buffer->data = data;
+		buffer->backing |= BASE_BUFFER_BACKING_PERSISTENT_MAP;
+	}
+	assert(!dumb_buffer->cpu_access);
+	base_dmabuf_begin_cpu_access(dumb_buffer->fd, access);
+	dumb_buffer->cpu_access = access;
+	if (access & BASE_ALLOCATOR_REQ_WRITE) {
+		buffer->serial++;
+	}
+	return dumb_buffer->data;
+}
+
+static void
+buffer_get_pixels_end(struct base_buffer *buffer, void *pixels)
+{
+	/* The mapping stays alive until buffer_destroy() */
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	assert(pixels == dumb_buffer->data);
+	base_dmabuf_end_cpu_access(dumb_buffer->fd, dumb_buffer->cpu_access);
+	dumb_buffer->cpu_access = 0;
+}
+
+static void
+buffer_lock(struct base_buffer *buffer)
+{
+	if (!atomic_fetch_add(&buffer->locks, 1)) {
+		struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+		base_buffer_pool_acquire(&dumb_buffer->allocator->pool, buffer);
+	}
+}
+
+static void
+buffer_destroy(struct base_buffer *buffer)
+{
+	assert(!buffer->locks);
+	buffer->impl->destroy_attachments(buffer);
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	base_buffer_pool_remove(&dumb_buffer->allocator->pool, buffer);
+	if (dumb_buffer->data) {
+		munmap(dumb_buffer->data, dumb_buffer->byte_size);
+	}
+	close(dumb_buffer->fd);
+	dumb_destroy(dumb_buffer->allocator->drm_fd, dumb_buffer->handle);
+	free(dumb_buffer);
+}
+
+static void
+buffer_unlock(struct base_buffer *buffer)
+{
+	const int locks = atomic_fetch_sub(&buffer->locks, 1);
+	assert(locks >= 1);
+
+	if (locks > 1) {
+		return;
+	}
+
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	base_buffer_pool_release(&dumb_buffer->allocator->pool, buffer);
+}
+
+static bool
+buffer_is_exact_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+{
+	return buffer->width == width && buffer->height == height
+		&& buffer->fourcc == fourcc && buffer->modifier == modifier;
+}
+
+static bool
+buffer_is_close_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+{
+	/* The pitch is chosen by the driver, so there is no safe way to re-use a dumb buffer for other dimensions */
+	return false;
+}
+
+static uint32_t
+buffer_get_byte_size(struct base_buffer *buffer)
+{
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	return dumb_buffer->byte_size;
+}
+
+static int
+buffer_get_fd(struct base_buffer *buffer)
+{
+	struct drm_dumb_allocator_buffer *dumb_buffer = (void *)buffer;
+	return dumb_buffer->fd;
+}
+
+static const struct base_buffer_impl buffer_impl = {
+	.get_pixels = buffer_get_pixels,
+	.get_pixels_end = buffer_get_pixels_end,
+	.get_wl_buffer = base_buffer_common_get_wl_buffer,
+	.lock = buffer_lock,
+	.unlock = buffer_unlock,
+	.mark_dirty = base_buffer_common_mark_dirty,
+	.add_damage = base_buffer_common_add_damage,
+	.get_damage = base_buffer_common_get_damage,
+	.is_idle = base_buffer_common_is_idle,
+	.get_attachment = base_buffer_common_get_attachment,
+	.set_attachment = base_buffer_common_set_attachment,
+
+	/* Internal export helpers */
+	.get_fd = buffer_get_fd,
+	.get_byte_size = buffer_get_byte_size,
+
+	/* Pool support */
+	.is_exact_match = buffer_is_exact_match,
+	.is_close_match = buffer_is_close_match,
+	.destroy = buffer_destroy,
+
+	/* Internal helpers */
+	.destroy_attachments = base_buffer_common_destroy_attachments,
+};
+
+static struct base_buffer *
+allocator_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	struct drm_dumb_allocator *alloc = (void *)allocator;
+	usage &= ~BASE_BUFFER_USAGE_HINTS;
+
+	const uint32_t bytes_per_pixel = fourcc_get_bytes_per_pixel(fourcc);
+	if (!bytes_per_pixel) {
+		log("Failed to parse fourcc format 0x%x", fourcc);
+		return NULL;
+	}
+
+	if (modifier != DRM_FORMAT_MOD_LINEAR) {
+		log("DRM dumb allocator only supports DRM_FORMAT_MOD_LINEAR modifier");
+		return NULL;
+	}
+
+	if (fourcc_get_plane_count(fourcc) != 1) {
+		log("DRM dumb allocator only supports single plane formats");
+		return NULL;
+	}
+
+	struct base_buffer *buffer = base_buffer_pool_get_buffer(
+		&alloc->pool, width, height, fourcc, modifier, usage);
+	if (buffer) {
+		return buffer;
+	}
+
+	/*
+	 * Dumb buffers are usually mapped write-combined, which is fine for
+	 * filling them but makes every CPU read uncached.
+	 */
+	if (usage & BASE_BUFFER_USAGE_CPU_READ) {
+		log("Warning: CPU reads from DRM dumb buffers are slow");
+	}
+
+	struct drm_mode_create_dumb create = {
+		.width = width,
+		.height = height,
+		.bpp = bytes_per_pixel * 8,
+	};
+	if (drmIoctl(alloc->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		perror("Failed to create dumb buffer");
+		return NULL;
+	}
+
+	int fd = -1;
+	if (drmPrimeHandleToFD(alloc->drm_fd, create.handle, DRM_CLOEXEC | DRM_RDWR, &fd) < 0) {
+		perror("Failed to export dumb buffer");
+		dumb_destroy(alloc->drm_fd, create.handle);
+		return NULL;
+	}
+
+	struct drm_dumb_allocator_buffer *dumb_buffer = calloc(1, sizeof(*dumb_buffer));
+	assert(dumb_buffer);
+	*dumb_buffer = (struct drm_dumb_allocator_buffer) {
+		.base = {
+			.impl = &buffer_impl,
+
+			/* Props */
+			.caps = allocator->capabilities,
+			.usage = usage,
+			.width = width,
+			.height = height,
+			.fourcc = fourcc,
+			.modifier = DRM_FORMAT_MOD_LINEAR,
+			.stride = create.pitch,
+			.plane_count = 1,
+			.planes = { { .fd = fd, .stride = create.pitch } },
+		},
+		.allocator = alloc,
+		.fd = fd,
+		.handle = create.handle,
+		.byte_size = create.size,
+	};
+	base_buffer_common_init(&dumb_buffer->base);
+	base_buffer_pool_add(&alloc->pool, &dumb_buffer->base);
+
+	BUFFER_LOG(true, dumb_buffer, "Created new dumb buffer with format 0x%08x (pitch %u)", fourcc, create.pitch);
+	return &dumb_buffer->base;
+}
+
+static void
+allocator_set_policy(struct base_allocator *allocator, const struct base_buffer_pool_policy *policy)
+{
+	struct drm_dumb_allocator *alloc = (void *)allocator;
+	base_buffer_pool_set_policy(&alloc->pool, policy);
+}
+
+static void
+allocator_destroy(struct base_allocator *allocator)
+{
+	struct drm_dumb_allocator *alloc = (void *)allocator;
+
+	struct base_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &alloc->pool.buffers, link) {
+		if (buffer->locks) {
+			log("Warning: locked buffer found in destroying drm_allocator");
+		} else {
+			buffer->impl->destroy(buffer);
+		}
+	}
+	base_buffer_pool_finish(&alloc->pool);
+	free(allocator);
+}
+
+struct base_allocator *
+drm_allocator_create(int drm_fd)
+{
+	uint64_t has_dumb = 0;
+	if (drmGetCap(drm_fd, DRM_CAP_DUMB_BUFFER, &has_dumb) < 0 || !has_dumb) {
+		log("DRM device does not support dumb buffers");
+		return NULL;
+	}
+
+	struct drm_dumb_allocator *alloc = calloc(1, sizeof(*alloc));
+	assert(alloc);
+	*alloc = (struct drm_dumb_allocator) {
+		.base = {
+			.create_buffer = allocator_create_buffer,
+			.create_buffer_from_list = base_allocator_common_create_buffer_from_list,
+			.reserve = base_allocator_common_reserve,
+			.set_policy = allocator_set_policy,
+			.destroy = allocator_destroy,
+			.capabilities = BASE_ALLOCATOR_CAP_EXPORT_DMABUF | BASE_ALLOCATOR_CAP_CPU_ACCESS,
+			.pool = &alloc->pool,
+		},
+		.drm_fd = drm_fd,
+	};
+	base_buffer_pool_init(&alloc->pool);
+	return &alloc->base;
+}
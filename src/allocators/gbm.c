@@ -9,30 +9,84 @@
 #include "buffer.h"
 #include "log.h"
 
-/* Defined in src/allocators/common.c */
-void base_buffer_common_init(struct base_buffer *buffer);
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/* Allocation granularity while the requested size keeps changing, e.g. during an interactive resize */
+#define GBM_RESIZE_STEP 128
 
 struct gbm_bo_allocator {
 	struct base_allocator base;
 	struct gbm_device *device;
-	struct wl_list buffers;
+	struct base_buffer_pool pool;
 };
 
 struct gbm_bo_allocator_buffer {
 	struct base_buffer base;
 
-	int fd;
 	struct gbm_bo *bo;
 	uint32_t byte_size;
 	struct gbm_bo_allocator *allocator;
+	/* Transient gbm_bo_map() between get_pixels() and get_pixels_end() */
 	void *map_data;
+	/* Stride of the bo, buffer->stride holds the one of the transient mapping meanwhile */
+	uint32_t bo_stride;
+	/* Persistent mapping of linear buffers, kept until the buffer is destroyed */
+	void *data;
+	bool map_persistent_failed;
+	/* Access of the current get_pixels() on the persistent mapping */
+	uint32_t cpu_access;
 };
 
+static void *
+buffer_map_persistent(struct gbm_bo_allocator_buffer *gbm_buffer)
+{
+	struct base_buffer *buffer = &gbm_buffer->base;
+	if (gbm_buffer->data) {
+		return gbm_buffer->data;
+	}
+	if (gbm_buffer->map_persistent_failed) {
+		return NULL;
+	}
+
+	/*
+	 * Only linear buffers can be mapped directly, everything else needs
+	 * the driver to detile via gbm_bo_map(). Not all drivers support
+	 * mmap() on dmabufs, remember that and don't try again.
+	 */
+	void *data = MAP_FAILED;
+	if (buffer->modifier == DRM_FORMAT_MOD_LINEAR) {
+		const int map_flags = buffer->usage & BASE_BUFFER_USAGE_CPU
+			? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+		data = mmap(NULL, gbm_buffer->byte_size, PROT_READ | PROT_WRITE,
+			map_flags, buffer->planes[0].fd, 0);
+	}
+	if (data == MAP_FAILED) {
+		BUFFER_LOG(true, buffer, "Falling back to transient gbm_bo_map()");
+		gbm_buffer->map_persistent_failed = true;
+		return NULL;
+	}
+	BUFFER_LOG(true, buffer, "Mapped %u bytes", gbm_buffer->byte_size);
+	base_buffer_pool_count_map(&gbm_buffer->allocator->pool, buffer);
+	buffer->backing |= BASE_BUFFER_BACKING_PERSISTENT_MAP;
+	gbm_buffer->data = data;
+	return data;
+}
+
 static void *
 buffer_get_pixels(struct base_buffer *buffer, uint32_t access)
 {
 	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
-	assert(!gbm_buffer->map_data);
+	assert(!gbm_buffer->map_data && !gbm_buffer->cpu_access);
+
+	void *data = buffer_map_persistent(gbm_buffer);
+	if (data) {
+		base_dmabuf_begin_cpu_access(buffer->planes[0].fd, access);
+		gbm_buffer->cpu_access = access;
+		if (access & BASE_ALLOCATOR_REQ_WRITE) {
+			buffer->serial++;
+		}
+		return (uint8_t *)data + buffer->planes[0].offset;
+	}
 
 	uint32_t flags = 0;
 	if (access & BASE_ALLOCATOR_REQ_READ) {
@@ -41,18 +95,27 @@ buffer_get_pixels(struct base_buffer *buffer, uint32_t access)
 	if (access & BASE_ALLOCATOR_REQ_WRITE) {
 		flags |= GBM_BO_TRANSFER_WRITE;
 	}
+	/* Drivers map through a context shared by the device, see allocator_create_buffer_from_list() */
+	struct base_buffer_pool *pool = &gbm_buffer->allocator->pool;
 	uint32_t stride;
+	base_buffer_pool_lock(pool);
 	void *pixels = gbm_bo_map(gbm_buffer->bo, /*x*/0, /*y*/0,
 		buffer->width, buffer->height,
 		flags, &stride, &gbm_buffer->map_data
 	);
+	base_buffer_pool_unlock(pool);
 	if (!pixels || pixels == MAP_FAILED) {
 		log("Failed to mmap gbm_bo");
 		return NULL;
 	}
+	base_buffer_pool_count_map(pool, buffer);
 	if (flags & GBM_BO_TRANSFER_WRITE) {
 		buffer->serial++;
 	}
+	/* Drivers which detile or copy via a staging buffer pick their own stride */
+	gbm_buffer->bo_stride = buffer->stride;
+	buffer->stride = stride;
+	buffer->planes[0].stride = stride;
 	return pixels;
 }
 
@@ -60,42 +123,65 @@ static void
 buffer_get_pixels_end(struct base_buffer *buffer, void *pixels)
 {
 	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
+	if (gbm_buffer->data) {
+		/* The mapping stays alive until buffer_destroy() */
+		assert(pixels == (uint8_t *)gbm_buffer->data + buffer->planes[0].offset);
+		base_dmabuf_end_cpu_access(buffer->planes[0].fd, gbm_buffer->cpu_access);
+		gbm_buffer->cpu_access = 0;
+		return;
+	}
 	assert(gbm_buffer->map_data);
+	base_buffer_pool_lock(&gbm_buffer->allocator->pool);
 	gbm_bo_unmap(gbm_buffer->bo, gbm_buffer->map_data);
+	base_buffer_pool_unlock(&gbm_buffer->allocator->pool);
 	gbm_buffer->map_data = NULL;
+	buffer->stride = gbm_buffer->bo_stride;
+	buffer->planes[0].stride = gbm_buffer->bo_stride;
 }
 
 static void
 buffer_lock(struct base_buffer *buffer)
 {
-	buffer->locks++;
+	if (!atomic_fetch_add(&buffer->locks, 1)) {
+		struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
+		base_buffer_pool_acquire(&gbm_buffer->allocator->pool, buffer);
+	}
 }
 
 static void
 buffer_destroy(struct base_buffer *buffer)
 {
 	assert(!buffer->locks);
-	buffer->destroy_attachments(buffer);
-	wl_list_remove(&buffer->link);
+	buffer->impl->destroy_attachments(buffer);
 	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
-	close(gbm_buffer->fd);
+	base_buffer_pool_remove(&gbm_buffer->allocator->pool, buffer);
+	if (gbm_buffer->data) {
+		munmap(gbm_buffer->data, gbm_buffer->byte_size);
+	}
+	for (uint32_t i = 0; i < buffer->plane_count; i++) {
+		if (buffer->planes[i].fd >= 0) {
+			close(buffer->planes[i].fd);
+		}
+	}
+	base_buffer_pool_lock(&gbm_buffer->allocator->pool);
 	gbm_bo_destroy(gbm_buffer->bo);
+	base_buffer_pool_unlock(&gbm_buffer->allocator->pool);
 	free(gbm_buffer);
 }
 
 static void
 buffer_unlock(struct base_buffer *buffer)
 {
-	assert(buffer->locks >= 1);
-	buffer->locks--;
+	const int locks = atomic_fetch_sub(&buffer->locks, 1);
+	assert(locks >= 1);
 
-	//BUFFER_LOG(true, buffer, "unlock buffer, now at %u", buffer->locks);
-	if (buffer->locks) {
+	//BUFFER_LOG(true, buffer, "unlock buffer, now at %u", locks - 1);
+	if (locks > 1) {
 		return;
 	}
 
 	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
-	base_buffer_pool_cleanup(&gbm_buffer->allocator->buffers);
+	base_buffer_pool_release(&gbm_buffer->allocator->pool, buffer);
 }
 
 static bool
@@ -108,6 +194,20 @@ buffer_is_exact_match(struct base_buffer *buffer, uint32_t width, uint32_t heigh
 static bool
 buffer_is_close_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
 {
+	/*
+	 * The layout of a bo is up to the driver, so only the presented region
+	 * can change. Consumers crop to width x height, see buffer->alloc_width.
+	 */
+	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
+	if (gbm_buffer->allocator->pool.policy.exact_size) {
+		return false;
+	}
+	if (buffer->fourcc == fourcc && buffer->modifier == modifier
+			&& width <= buffer->alloc_width && height <= buffer->alloc_height) {
+		buffer->width = width;
+		buffer->height = height;
+		return true;
+	}
 	return false;
 }
 
@@ -121,10 +221,35 @@ buffer_get_byte_size(struct base_buffer *buffer)
 static int
 buffer_get_fd(struct base_buffer *buffer)
 {
-	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)buffer;
-	return gbm_buffer->fd;
+	return buffer->planes[0].fd;
 }
 
+static const struct base_buffer_impl buffer_impl = {
+	.get_pixels = buffer_get_pixels,
+	.get_pixels_end = buffer_get_pixels_end,
+	.get_wl_buffer = base_buffer_common_get_wl_buffer,
+	.lock = buffer_lock,
+	.unlock = buffer_unlock,
+	.mark_dirty = base_buffer_common_mark_dirty,
+	.add_damage = base_buffer_common_add_damage,
+	.get_damage = base_buffer_common_get_damage,
+	.is_idle = base_buffer_common_is_idle,
+	.get_attachment = base_buffer_common_get_attachment,
+	.set_attachment = base_buffer_common_set_attachment,
+
+	/* Internal export helpers */
+	.get_fd = buffer_get_fd,
+	.get_byte_size = buffer_get_byte_size,
+
+	/* Pool support */
+	.is_exact_match = buffer_is_exact_match,
+	.is_close_match = buffer_is_close_match,
+	.destroy = buffer_destroy,
+
+	/* Internal helpers */
+	.destroy_attachments = base_buffer_common_destroy_attachments,
+};
+
 struct base_buffer *
 gbm_allocator_wrap_gbm_bo(struct base_allocator *allocator, struct gbm_bo *bo)
 {
@@ -138,11 +263,7 @@ gbm_allocator_wrap_gbm_bo(struct base_allocator *allocator, struct gbm_bo *bo)
 
 	*gbm_buffer = (struct gbm_bo_allocator_buffer) {
 		.base = {
-			/* API */
-			.get_pixels = buffer_get_pixels,
-			.get_pixels_end = buffer_get_pixels_end,
-			.lock = buffer_lock,
-			.unlock = buffer_unlock,
+			.impl = &buffer_impl,
 
 			/* Props */
 			.caps = allocator->capabilities,
@@ -151,69 +272,188 @@ gbm_allocator_wrap_gbm_bo(struct base_allocator *allocator, struct gbm_bo *bo)
 			.stride = gbm_bo_get_stride(bo),
 			.fourcc = gbm_bo_get_format(bo),
 			.modifier = gbm_bo_get_modifier(bo),
-
-			/* Internal export helpers */
-			.get_fd = buffer_get_fd,
-			.get_byte_size = buffer_get_byte_size,
-
-			/* Pool support */
-			.is_exact_match = buffer_is_exact_match,
-			.is_close_match = buffer_is_close_match,
-			.destroy = buffer_destroy,
 		},
 		.bo = bo,
-		.fd = gbm_bo_get_fd(bo),
 		.allocator = alloc,
-		.byte_size = gbm_bo_get_stride(bo) * gbm_bo_get_height(bo),
 	};
+
+	struct base_buffer *buffer = &gbm_buffer->base;
+	buffer->plane_count = gbm_bo_get_plane_count(bo);
+	assert(buffer->plane_count >= 1 && buffer->plane_count <= BASE_BUFFER_MAX_PLANES);
+	for (uint32_t i = 0; i < buffer->plane_count; i++) {
+		buffer->planes[i] = (struct base_buffer_plane) {
+			.fd = gbm_bo_get_fd_for_plane(bo, i),
+			.offset = gbm_bo_get_offset(bo, i),
+			.stride = gbm_bo_get_stride_for_plane(bo, i),
+		};
+		if (buffer->planes[i].fd < 0) {
+			perror("Failed to export gbm buffer plane");
+		}
+	}
+
+	/* The dmabuf knows its real size, including all planes and any padding */
+	off_t byte_size = lseek(buffer->planes[0].fd, 0, SEEK_END);
+	gbm_buffer->byte_size = byte_size > 0
+		? (uint32_t)byte_size : buffer->stride * buffer->height;
+
 	base_buffer_common_init(&gbm_buffer->base);
+	base_buffer_pool_add(&alloc->pool, &gbm_buffer->base);
 
 	BUFFER_LOG(true, gbm_buffer, "Wrapped gbm buffer with format 0x%08x (modifier 0x%016lx)", gbm_buffer->base.fourcc, gbm_buffer->base.modifier);
 
 	return &gbm_buffer->base;
 }
 
-static struct base_buffer *
-allocator_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+static uint32_t
+usage_to_gbm_flags(uint32_t usage)
 {
-	struct gbm_bo_allocator *alloc = (void *)allocator;
-	struct gbm_bo_allocator_buffer *gbm_buffer = (void *)base_buffer_pool_get_buffer(
-		&alloc->buffers, width, height, fourcc, modifier);
+	uint32_t flags = 0;
+	if (usage & BASE_BUFFER_USAGE_SCANOUT) {
+		flags |= GBM_BO_USE_SCANOUT;
+	}
+	if (usage & BASE_BUFFER_USAGE_RENDERING) {
+		flags |= GBM_BO_USE_RENDERING;
+	}
+	return flags;
+}
+
+static struct gbm_bo *
+create_bo(struct gbm_bo_allocator *alloc, uint32_t width, uint32_t height,
+		uint32_t fourcc, const struct base_format *formats, size_t format_count, uint32_t usage)
+{
+	/* Let the driver pick the best layout out of all modifiers of this fourcc */
+	uint64_t *modifiers = calloc(format_count, sizeof(*modifiers));
+	assert(modifiers);
+	uint32_t modifier_count = 0;
+	bool implicit = false;
+	bool linear = false;
+	for (size_t i = 0; i < format_count; i++) {
+		if (formats[i].fourcc != fourcc) {
+			continue;
+		} else if (formats[i].modifier == DRM_FORMAT_MOD_INVALID) {
+			implicit = true;
+		} else {
+			linear |= formats[i].modifier == DRM_FORMAT_MOD_LINEAR;
+			modifiers[modifier_count++] = formats[i].modifier;
+		}
+	}
 
-	if (gbm_buffer) {
-		/* Ensure recently used buffers are at the end of the list */
-		struct base_buffer *buffer = &gbm_buffer->base;
-		wl_list_remove(&buffer->link);
-		wl_list_insert(alloc->buffers.prev, &buffer->link);
-		return buffer;
+	/*
+	 * CPU access to tiled buffers goes through a detiling copy in gbm_bo_map(),
+	 * prefer a linear layout which can be mapped directly when there is one.
+	 */
+	const bool cpu_access = usage & BASE_BUFFER_USAGE_CPU;
+	if (cpu_access && linear) {
+		modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+		modifier_count = 1;
 	}
 
-	uint32_t flags = 0;
-	struct gbm_bo *bo = gbm_bo_create_with_modifiers2(alloc->device, width, height, fourcc, &modifier, 1, flags);
-	if (!bo) {
-		perror("Failed to create gbm buffer");
-		return NULL;
+	uint32_t flags = usage_to_gbm_flags(usage);
+	struct gbm_bo *bo = NULL;
+	if (modifier_count) {
+		bo = gbm_bo_create_with_modifiers2(alloc->device, width, height,
+			fourcc, modifiers, modifier_count, flags);
 	}
+	if (!bo && implicit) {
+		if (cpu_access) {
+			flags |= GBM_BO_USE_LINEAR;
+		}
+		bo = gbm_bo_create(alloc->device, width, height, fourcc, flags);
+	}
+	free(modifiers);
+	return bo;
+}
+
+static struct base_buffer *
+create_buffer_from_list(struct gbm_bo_allocator *alloc, uint32_t width, uint32_t height,
+		const struct base_format *formats, size_t format_count, uint32_t usage)
+{
+	struct base_allocator *allocator = &alloc->base;
+	const bool resizing = (usage & BASE_BUFFER_USAGE_HINT_RESIZING) && !alloc->pool.policy.exact_size;
+	usage &= ~BASE_BUFFER_USAGE_HINTS;
+
+	for (size_t i = 0; i < format_count; i++) {
+		struct base_buffer *buffer = base_buffer_pool_get_buffer(
+			&alloc->pool, width, height, formats[i].fourcc, formats[i].modifier, usage);
+		if (buffer) {
+			return buffer;
+		}
+	}
+
+	/* Leave room to grow so the following requests can be served by cropping */
+	const uint32_t alloc_width = resizing ? ALIGN(width, GBM_RESIZE_STEP) : width;
+	const uint32_t alloc_height = resizing ? ALIGN(height, GBM_RESIZE_STEP) : height;
 
-	struct base_buffer *buffer = gbm_allocator_wrap_gbm_bo(allocator, bo);
-	BUFFER_LOG(true, buffer, "Created new gbm buffer with format 0x%08x (modifier 0x%016lx)", fourcc, modifier);
-	wl_list_insert(alloc->buffers.prev, &buffer->link);
+	/* Try each fourcc once, in order of first appearance */
+	for (size_t i = 0; i < format_count; i++) {
+		const uint32_t fourcc = formats[i].fourcc;
+		bool tried = false;
+		for (size_t j = 0; j < i && !tried; j++) {
+			tried = formats[j].fourcc == fourcc;
+		}
+		if (tried) {
+			continue;
+		}
+		struct gbm_bo *bo = create_bo(alloc, alloc_width, alloc_height, fourcc,
+			formats, format_count, usage);
+		if (bo) {
+			struct base_buffer *buffer = gbm_allocator_wrap_gbm_bo(allocator, bo);
+			buffer->usage = usage;
+			buffer->width = width;
+			buffer->height = height;
+			BUFFER_LOG(true, buffer, "Created new %ux%u gbm buffer with format 0x%08x (modifier 0x%016lx)",
+				buffer->alloc_width, buffer->alloc_height, buffer->fourcc, buffer->modifier);
+			return buffer;
+		}
+	}
+	perror("Failed to create gbm buffer");
+	return NULL;
+}
+
+static struct base_buffer *
+allocator_create_buffer_from_list(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		const struct base_format *formats, size_t format_count, uint32_t usage)
+{
+	/*
+	 * gbm devices are not guaranteed to be thread safe, every gbm call on the
+	 * device or its bos holds the pool mutex.
+	 */
+	struct gbm_bo_allocator *alloc = (void *)allocator;
+	base_buffer_pool_lock(&alloc->pool);
+	struct base_buffer *buffer = create_buffer_from_list(alloc, width, height, formats, format_count, usage);
+	base_buffer_pool_unlock(&alloc->pool);
 	return buffer;
 }
 
+static struct base_buffer *
+allocator_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	const struct base_format format = { fourcc, modifier };
+	return allocator_create_buffer_from_list(allocator, width, height, &format, 1, usage);
+}
+
+static void
+allocator_set_policy(struct base_allocator *allocator, const struct base_buffer_pool_policy *policy)
+{
+	struct gbm_bo_allocator *alloc = (void *)allocator;
+	base_buffer_pool_set_policy(&alloc->pool, policy);
+}
+
 static void
 allocator_destroy(struct base_allocator *allocator)
 {
 	struct gbm_bo_allocator *alloc = (void *)allocator;
 
 	struct base_buffer *buffer, *tmp;
-	wl_list_for_each_safe(buffer, tmp, &alloc->buffers, link) {
+	wl_list_for_each_safe(buffer, tmp, &alloc->pool.buffers, link) {
 		if (buffer->locks) {
 			log("Warning: locked buffer found in destroying gbm_allocator");
 		} else {
-			buffer->destroy(buffer);
+			buffer->impl->destroy(buffer);
 		}
 	}
+	base_buffer_pool_finish(&alloc->pool);
 	gbm_device_destroy(alloc->device);
 	free(allocator);
 }
@@ -226,8 +466,12 @@ gbm_allocator_create(int drm_fd)
 	*alloc = (struct gbm_bo_allocator) {
 		.base = {
 			.create_buffer = allocator_create_buffer,
+			.create_buffer_from_list = allocator_create_buffer_from_list,
+			.reserve = base_allocator_common_reserve,
+			.set_policy = allocator_set_policy,
 			.destroy = allocator_destroy,
 			.capabilities = BASE_ALLOCATOR_CAP_EXPORT_DMABUF | BASE_ALLOCATOR_CAP_CPU_ACCESS,
+			.pool = &alloc->pool,
 		},
 		.device = gbm_create_device(drm_fd),
 	};
@@ -236,6 +480,6 @@ gbm_allocator_create(int drm_fd)
 		free(alloc);
 		return NULL;
 	}
-	wl_list_init(&alloc->buffers);
+	base_buffer_pool_init(&alloc->pool);
 	return &alloc->base;
 }
@@ -1,37 +1,166 @@
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include <wayland-util.h>
 #include "buffer.h"
+#include "fourcc.h"
 #include "log.h"
 
+/*
+ * Only unlocked buffers are part of the index. They are added when the
+ * last lock is released and removed again when they are handed out by
+ * base_buffer_pool_get_buffer(), locked or destroyed.
+ */
+
+/* All initialized pools, for base_buffer_pools_expire() */
+static struct wl_list pools = { &pools, &pools };
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Callers hold the pool mutex */
+#define STATS_ADD(pool, class, counter, value) do { \
+	(pool)->stats.total.counter += (value); \
+	(pool)->stats.size_classes[class].counter += (value); \
+} while (0)
+
+static uint64_t
+get_time_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+exact_bucket(uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	uint64_t hash = width;
+	hash = hash * 31 + height;
+	hash = hash * 31 + fourcc;
+	hash = hash * 31 + modifier;
+	hash = hash * 31 + usage;
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+	return hash & (BASE_BUFFER_POOL_BUCKETS - 1);
+}
+
+static uint32_t
+size_class(uint32_t byte_size)
+{
+	/* floor(log2(byte_size)) */
+	return byte_size ? 31 - __builtin_clz(byte_size) : 0;
+}
+
+static void
+index_add(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	assert(!buffer->pool.available);
+	buffer->pool.available = true;
+	buffer->pool.released_ms = get_time_msec();
+	pool->available_count++;
+
+	wl_list_insert(pool->available.prev, &buffer->pool.available_link);
+
+	const uint32_t bucket = exact_bucket(buffer->width, buffer->height,
+		buffer->fourcc, buffer->modifier, buffer->usage);
+	wl_list_insert(&pool->exact[bucket], &buffer->pool.exact_link);
+
+	const uint32_t class = buffer->pool.size_class;
+	wl_list_insert(&pool->size_classes[class], &buffer->pool.size_link);
+	pool->size_class_counts[class]++;
+	pool->size_class_mask |= 1u << class;
+}
+
+static void
+index_remove(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	assert(buffer->pool.available);
+	buffer->pool.available = false;
+	pool->available_count--;
+
+	wl_list_remove(&buffer->pool.available_link);
+	wl_list_remove(&buffer->pool.exact_link);
+	wl_list_remove(&buffer->pool.size_link);
+
+	const uint32_t class = buffer->pool.size_class;
+	if (!--pool->size_class_counts[class]) {
+		pool->size_class_mask &= ~(1u << class);
+	}
+}
+
+static bool
+exceeds_slack(struct base_buffer_pool *pool, struct base_buffer *buffer, uint32_t min_size)
+{
+	const uint32_t max_slack_percent = pool->policy.max_slack_percent;
+	if (!max_slack_percent || min_size >= buffer->pool.byte_size) {
+		return false;
+	}
+	const uint64_t slack = buffer->pool.byte_size - min_size;
+	return slack * 100 > (uint64_t)buffer->pool.byte_size * max_slack_percent;
+}
+
+static bool
+skip_busy(struct base_buffer *buffer, bool allow_busy)
+{
+	return !allow_busy && !buffer->impl->is_idle(buffer, BASE_ALLOCATOR_REQ_WRITE);
+}
+
 static struct base_buffer *
-find_close_match(struct wl_list *buffers, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+find_close_match(struct base_buffer_pool *pool, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage, bool allow_busy)
 {
-	/* Tries to find last recently used close match from the back of the list */
-	struct base_buffer *buffer;
-	wl_list_for_each_reverse(buffer, buffers, link) {
-		if (buffer->locks) {
-			continue;
-		}
-		if (buffer->is_close_match(buffer, width, height, fourcc, modifier)) {
-			BUFFER_LOG(true, buffer, "Reusing existing buffer due to close match");
-			buffer->destroy_attachments(buffer);
-			return buffer;
+	/*
+	 * Buffers in size classes below the minimal size of the request can't
+	 * match. Within each class try the most recently released buffer first.
+	 * Unlike the exact match this walks the class, it is only reached once
+	 * the exact match failed.
+	 */
+	const uint32_t min_size = fourcc_get_plane_layout(fourcc, width, height, NULL, NULL);
+	uint32_t mask = pool->size_class_mask & (UINT32_MAX << size_class(min_size));
+	while (mask) {
+		const uint32_t class = __builtin_ctz(mask);
+		mask &= mask - 1;
+
+		struct base_buffer *buffer;
+		wl_list_for_each(buffer, &pool->size_classes[class], pool.size_link) {
+			/* A readback buffer may live in memory unsuitable for scanout and vice versa */
+			if (buffer->usage != usage || exceeds_slack(pool, buffer, min_size)
+					|| skip_busy(buffer, allow_busy)) {
+				continue;
+			}
+			/*
+			 * Attachments like a wl_buffer or a KMS framebuffer describe the
+			 * allocation. They stay valid if the buffer is only cropped.
+			 */
+			const uint32_t alloc_width = buffer->alloc_width;
+			const uint32_t alloc_height = buffer->alloc_height;
+			const uint32_t old_fourcc = buffer->fourcc;
+			const uint32_t stride = buffer->stride;
+			if (buffer->impl->is_close_match(buffer, width, height, fourcc, modifier)) {
+				BUFFER_LOG(true, buffer, "Reusing existing buffer due to close match");
+				if (buffer->alloc_width != alloc_width || buffer->alloc_height != alloc_height
+						|| buffer->fourcc != old_fourcc || buffer->stride != stride) {
+					buffer->impl->destroy_attachments(buffer);
+				}
+				return buffer;
+			}
 		}
 	}
 	return NULL;
 }
 
 static struct base_buffer *
-find_exact_match(struct wl_list *buffers, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+find_exact_match(struct base_buffer_pool *pool, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage, bool allow_busy)
 {
-	/* Tries to find last recently used exact match from the back of the list */
+	const uint32_t bucket = exact_bucket(width, height, fourcc, modifier, usage);
 	struct base_buffer *buffer;
-	wl_list_for_each_reverse(buffer, buffers, link) {
-		if (buffer->locks) {
-			continue;
-		}
+	wl_list_for_each(buffer, &pool->exact[bucket], pool.exact_link) {
 		if (buffer->width == width && buffer->height == height
 			&& buffer->fourcc == fourcc && buffer->modifier == modifier
-			&& buffer->is_exact_match(buffer, width, height, fourcc, modifier)
+			&& buffer->usage == usage
+			&& buffer->impl->is_exact_match(buffer, width, height, fourcc, modifier)
+			&& !skip_busy(buffer, allow_busy)
 		) {
 			BUFFER_LOG(true, buffer, "Reusing existing buffer due to exact match");
 			return buffer;
@@ -40,46 +169,314 @@ find_exact_match(struct wl_list *buffers, uint32_t width, uint32_t height, uint3
 	return NULL;
 }
 
-struct base_buffer *
-base_buffer_pool_get_buffer(struct wl_list *buffers, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+static void
+evict(struct base_buffer_pool *pool, struct base_buffer *buffer)
 {
-	struct base_buffer *buffer = find_exact_match(buffers, width, height, fourcc, modifier);
-	if (!buffer) {
-		buffer = find_close_match(buffers, width, height, fourcc, modifier);
+	BUFFER_LOG(true, buffer,
+		"destroying buffer, now at %u/%u available buffers",
+		pool->available_count - 1, pool->total_count - 1
+	);
+	STATS_ADD(pool, buffer->pool.size_class, evictions, 1);
+	buffer->impl->destroy(buffer);
+}
+
+/* Only the limits of the given size class and the pool-wide ones, constant time per eviction */
+static void
+evict_over_policy(struct base_buffer_pool *pool, uint32_t class)
+{
+	const struct base_buffer_pool_policy *policy = &pool->policy;
+	/* The size class lists have the least recently released buffer at the tail */
+	while (policy->max_idle_per_size_class
+			&& pool->size_class_counts[class] > policy->max_idle_per_size_class) {
+		struct base_buffer *buffer = wl_container_of(pool->size_classes[class].prev, buffer, pool.size_link);
+		evict(pool, buffer);
+	}
+	while (!wl_list_empty(&pool->available)
+			&& ((policy->max_idle && pool->available_count > policy->max_idle)
+				|| (policy->max_resident_bytes && pool->resident_bytes > policy->max_resident_bytes))) {
+		struct base_buffer *buffer = wl_container_of(pool->available.next, buffer, pool.available_link);
+		evict(pool, buffer);
 	}
-	return buffer;
 }
 
 void
-base_buffer_pool_cleanup(struct wl_list *buffers)
+base_buffer_pool_init(struct base_buffer_pool *pool)
 {
-	uint32_t available_count = 0;
-	struct base_buffer *buffer, *tmp;
+	*pool = (struct base_buffer_pool) { 0 };
+
+	/* Recursive as destroying a buffer from within the pool calls base_buffer_pool_remove() */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pool->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	wl_list_init(&pool->buffers);
+	wl_list_init(&pool->available);
+	for (uint32_t i = 0; i < BASE_BUFFER_POOL_BUCKETS; i++) {
+		wl_list_init(&pool->exact[i]);
+	}
+	for (uint32_t i = 0; i < BASE_BUFFER_POOL_SIZE_CLASSES; i++) {
+		wl_list_init(&pool->size_classes[i]);
+	}
+	pool->policy = (struct base_buffer_pool_policy) {
+		.max_idle = BASE_BUFFER_POOL_DEFAULT_MAX_IDLE,
+		.max_slack_percent = BASE_BUFFER_POOL_DEFAULT_MAX_SLACK_PERCENT,
+	};
+	pthread_mutex_lock(&pools_mutex);
+	wl_list_insert(&pools, &pool->link);
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+void
+base_buffer_pool_finish(struct base_buffer_pool *pool)
+{
+	pthread_mutex_lock(&pools_mutex);
+	wl_list_remove(&pool->link);
+	pthread_mutex_unlock(&pools_mutex);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void
+base_buffer_pool_lock(struct base_buffer_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+}
+
+void
+base_buffer_pool_unlock(struct base_buffer_pool *pool)
+{
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void
+base_buffer_pool_set_policy(struct base_buffer_pool *pool, const struct base_buffer_pool_policy *policy)
+{
+	base_buffer_pool_lock(pool);
+	pool->policy = *policy;
+	base_buffer_pool_cleanup(pool);
+	base_buffer_pool_expire(pool);
+	base_buffer_pool_unlock(pool);
+}
+
+uint32_t
+base_buffer_pool_get_stride_align(struct base_buffer_pool *pool, uint32_t usage)
+{
+	const bool gpu = usage & (BASE_BUFFER_USAGE_SCANOUT | BASE_BUFFER_USAGE_RENDERING);
+	base_buffer_pool_lock(pool);
+	const uint32_t align = gpu ? pool->policy.gpu_stride_align : pool->policy.stride_align;
+	base_buffer_pool_unlock(pool);
+	if (align) {
+		return align;
+	}
+	return gpu ? BASE_BUFFER_POOL_DEFAULT_GPU_STRIDE_ALIGN : BASE_BUFFER_POOL_DEFAULT_STRIDE_ALIGN;
+}
+
+void
+base_buffer_pool_add(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	/* New buffers are handed out to the caller and join the index once unlocked */
+	base_buffer_pool_lock(pool);
+	buffer->pool.owner = pool;
+	buffer->pool.available = false;
+	buffer->pool.byte_size = buffer->impl->get_byte_size(buffer);
+	buffer->pool.size_class = size_class(buffer->pool.byte_size);
+	wl_list_insert(pool->buffers.prev, &buffer->link);
+	pool->total_count++;
+	pool->resident_bytes += buffer->pool.byte_size;
+	STATS_ADD(pool, buffer->pool.size_class, misses, 1);
+	STATS_ADD(pool, buffer->pool.size_class, live_buffers, 1);
+	STATS_ADD(pool, buffer->pool.size_class, resident_bytes, buffer->pool.byte_size);
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pool_remove(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	base_buffer_pool_lock(pool);
+	if (buffer->pool.available) {
+		index_remove(pool, buffer);
+	}
+	wl_list_remove(&buffer->link);
+	pool->total_count--;
+	pool->resident_bytes -= buffer->pool.byte_size;
+	STATS_ADD(pool, buffer->pool.size_class, live_buffers, -1);
+	STATS_ADD(pool, buffer->pool.size_class, resident_bytes, -(uint64_t)buffer->pool.byte_size);
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pool_acquire(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	base_buffer_pool_lock(pool);
+	if (buffer->pool.available) {
+		index_remove(pool, buffer);
+	}
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pool_release(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	/*
+	 * The lock count is only stable under the pool mutex. If the buffer
+	 * got locked again since the caller dropped the last lock it stays out
+	 * of the index, base_buffer_pool_acquire() was a no-op in that case.
+	 */
+	base_buffer_pool_lock(pool);
+	if (!buffer->locks && !buffer->pool.available) {
+		index_add(pool, buffer);
+		evict_over_policy(pool, buffer->pool.size_class);
+	}
+	base_buffer_pool_unlock(pool);
+}
 
-	wl_list_for_each(buffer, buffers, link) {
-		if (!buffer->locks) {
-			available_count++;
+struct base_buffer *
+base_buffer_pool_get_buffer(struct base_buffer_pool *pool, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	/*
+	 * Prefer buffers the compositor and GPU are done with, even if that
+	 * means a close match. Otherwise get_pixels() would stall until the
+	 * fences of the busy buffer signal.
+	 */
+	base_buffer_pool_lock(pool);
+	struct base_buffer *buffer = NULL;
+	for (int allow_busy = 0; allow_busy <= 1 && !buffer; allow_busy++) {
+		buffer = find_exact_match(pool, width, height, fourcc, modifier, usage, allow_busy);
+		if (buffer) {
+			STATS_ADD(pool, buffer->pool.size_class, exact_hits, 1);
+			break;
+		}
+		buffer = find_close_match(pool, width, height, fourcc, modifier, usage, allow_busy);
+		if (buffer) {
+			STATS_ADD(pool, buffer->pool.size_class, close_hits, 1);
 		}
 	}
-	if (available_count < AVAILABLE_DROP_THRESHOLD) {
-		return;
+	if (buffer) {
+		index_remove(pool, buffer);
 	}
-	uint32_t total_count = wl_list_length(buffers);
+	base_buffer_pool_unlock(pool);
+	return buffer;
+}
 
-	/* Ensure we are destroying the oldest unused buffer from the front of the list */
-	wl_list_for_each_safe(buffer, tmp, buffers, link) {
-		if (buffer->locks) {
-			continue;
+void
+base_buffer_pool_cleanup(struct base_buffer_pool *pool)
+{
+	/* Destroy the least recently released buffers until the policy is met */
+	base_buffer_pool_lock(pool);
+	for (uint32_t class = 0; class < BASE_BUFFER_POOL_SIZE_CLASSES; class++) {
+		evict_over_policy(pool, class);
+	}
+	base_buffer_pool_unlock(pool);
+}
+
+int
+base_buffer_pool_expire(struct base_buffer_pool *pool)
+{
+	base_buffer_pool_lock(pool);
+	const uint32_t timeout = pool->policy.idle_timeout_ms;
+	if (!timeout) {
+		base_buffer_pool_unlock(pool);
+		return -1;
+	}
+	const uint64_t now = get_time_msec();
+	while (!wl_list_empty(&pool->available)) {
+		struct base_buffer *buffer = wl_container_of(pool->available.next, buffer, pool.available_link);
+		const uint64_t expires_ms = buffer->pool.released_ms + timeout;
+		if (expires_ms > now) {
+			base_buffer_pool_unlock(pool);
+			return expires_ms - now;
 		}
-		total_count--;
-		available_count--;
 		BUFFER_LOG(true, buffer,
-			"destroying buffer, now at %u/%u available buffers",
-			available_count, total_count
+			"destroying buffer idle for %lu ms, now at %u/%u available buffers",
+			now - buffer->pool.released_ms,
+			pool->available_count - 1, pool->total_count - 1
 		);
-		buffer->destroy(buffer);
-		if (available_count < AVAILABLE_DROP_THRESHOLD) {
-			break;
-		};
+		STATS_ADD(pool, buffer->pool.size_class, evictions, 1);
+		buffer->impl->destroy(buffer);
+	}
+	base_buffer_pool_unlock(pool);
+	return -1;
+}
+
+void
+base_buffer_pool_trim(struct base_buffer_pool *pool)
+{
+	/* Least recently released first, like base_buffer_pool_cleanup() */
+	base_buffer_pool_lock(pool);
+	struct base_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &pool->available, pool.available_link) {
+		const uint32_t class = buffer->pool.size_class;
+		if (pool->available_count > pool->policy.pressure_min_idle) {
+			BUFFER_LOG(true, buffer, "destroying buffer due to memory pressure");
+			STATS_ADD(pool, class, trimmed_buffers, 1);
+			STATS_ADD(pool, class, trimmed_bytes, buffer->pool.byte_size);
+			buffer->impl->destroy(buffer);
+		} else if (buffer->impl->release_pages) {
+			STATS_ADD(pool, class, trimmed_bytes, buffer->impl->release_pages(buffer));
+		}
+	}
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pools_trim(void)
+{
+	struct base_buffer_pool *pool;
+	pthread_mutex_lock(&pools_mutex);
+	wl_list_for_each(pool, &pools, link) {
+		base_buffer_pool_trim(pool);
+	}
+	pthread_mutex_unlock(&pools_mutex);
+}
+
+void
+base_buffer_pool_count_map(struct base_buffer_pool *pool, struct base_buffer *buffer)
+{
+	base_buffer_pool_lock(pool);
+	STATS_ADD(pool, buffer->pool.size_class, maps, 1);
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pool_count_wl_buffer(struct base_buffer *buffer)
+{
+	struct base_buffer_pool *pool = buffer->pool.owner;
+	base_buffer_pool_lock(pool);
+	STATS_ADD(pool, buffer->pool.size_class, wl_buffers_created, 1);
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_buffer_pool_count_starvation(struct base_buffer_pool *pool, uint32_t byte_size)
+{
+	base_buffer_pool_lock(pool);
+	STATS_ADD(pool, size_class(byte_size), starvations, 1);
+	base_buffer_pool_unlock(pool);
+}
+
+void
+base_allocator_get_stats(struct base_allocator *allocator, struct base_allocator_stats *stats)
+{
+	struct base_buffer_pool *pool = allocator->pool;
+	base_buffer_pool_lock(pool);
+	*stats = pool->stats;
+	base_buffer_pool_unlock(pool);
+}
+
+int
+base_buffer_pools_expire(void)
+{
+	int next_timeout = -1;
+	struct base_buffer_pool *pool;
+	pthread_mutex_lock(&pools_mutex);
+	wl_list_for_each(pool, &pools, link) {
+		const int timeout = base_buffer_pool_expire(pool);
+		if (timeout >= 0 && (next_timeout < 0 || timeout < next_timeout)) {
+			next_timeout = timeout;
+		}
 	}
+	pthread_mutex_unlock(&pools_mutex);
+	return next_timeout;
 }
@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "log.h"
+
+/*
+ * 100 ms of stalls within a 2 s window. Unprivileged processes may
+ * only create triggers with a window of a multiple of 2 seconds.
+ */
+#define PSI_TRIGGER "some 100000 2000000"
+
+/* Path of the own cgroup v2 below /sys/fs/cgroup, without leading slash */
+static bool
+get_cgroup_path(char *path, size_t size)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	if (!file) {
+		return false;
+	}
+	bool found = false;
+	char line[512];
+	while (fgets(line, sizeof(line), file)) {
+		/* The unified hierarchy is the one with ID 0 and no controllers, e.g. "0::/user.slice/app.scope" */
+		if (strncmp(line, "0::/", 4)) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		found = snprintf(path, size, "%s", line + 4) < (int)size;
+		break;
+	}
+	fclose(file);
+	return found;
+}
+
+static int
+psi_trigger_create(const char *path)
+{
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	/* The kernel expects the terminating null byte as well */
+	if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Sum of the high and max counters of memory.events, reading it also re-arms the notification */
+static bool
+read_memory_events(int fd, uint64_t *events)
+{
+	char buf[256];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0) {
+		return false;
+	}
+	buf[len] = '\0';
+
+	*events = 0;
+	char *saveptr;
+	for (char *line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		uint64_t value;
+		if (sscanf(line, "high %" SCNu64, &value) == 1 || sscanf(line, "max %" SCNu64, &value) == 1) {
+			*events += value;
+		}
+	}
+	return true;
+}
+
+static int
+pressure_dispatch(struct base_memory_pressure *pressure, short revents)
+{
+	/*
+	 * PSI triggers report POLLERR once the cgroup is gone. kernfs signals
+	 * each change of memory.events with POLLERR | POLLPRI though, a removed
+	 * cgroup shows up as a failing read there.
+	 */
+	if ((revents & POLLNVAL) || (!pressure->is_events_file && (revents & (POLLERR | POLLHUP)))) {
+		log("Memory pressure trigger stopped working");
+		return -1;
+	}
+	if (!(revents & POLLPRI)) {
+		return 0;
+	}
+	if (!pressure->is_events_file) {
+		/* PSI triggers signal each time the threshold is exceeded */
+		return 1;
+	}
+	uint64_t events;
+	if (!read_memory_events(pressure->fd, &events)) {
+		perror("Failed to read memory.events");
+		return -1;
+	}
+	/* The file also changes for unrelated counters like oom_kill */
+	const bool under_pressure = events != pressure->events;
+	pressure->events = events;
+	return under_pressure ? 1 : 0;
+}
+
+static void
+pressure_destroy(struct base_memory_pressure *pressure)
+{
+	close(pressure->fd);
+	free(pressure);
+}
+
+struct base_memory_pressure *
+base_memory_pressure_create(void)
+{
+	char cgroup[256] = { 0 };
+	char path[512];
+	const bool has_cgroup = get_cgroup_path(cgroup, sizeof(cgroup));
+
+	bool is_events_file = false;
+	int fd = -1;
+	if (has_cgroup) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/memory.pressure", cgroup);
+		fd = psi_trigger_create(path);
+	}
+	if (fd < 0) {
+		fd = psi_trigger_create("/proc/pressure/memory");
+	}
+	if (fd < 0 && has_cgroup) {
+		/* Kernels without PSI, only covers hitting the cgroup limits */
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/memory.events", cgroup);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		is_events_file = fd >= 0;
+	}
+	if (fd < 0) {
+		log("Memory pressure monitoring not available");
+		return NULL;
+	}
+
+	struct base_memory_pressure *pressure = calloc(1, sizeof(*pressure));
+	assert(pressure);
+	*pressure = (struct base_memory_pressure) {
+		.dispatch = pressure_dispatch,
+		.destroy = pressure_destroy,
+		.fd = fd,
+		.is_events_file = is_events_file,
+	};
+	if (is_events_file && !read_memory_events(fd, &pressure->events)) {
+		perror("Failed to read memory.events");
+	}
+	return pressure;
+}
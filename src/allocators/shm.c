@@ -1,7 +1,12 @@
-#define _GNU_SOURCE /* required for memfd_create() */
+#define _GNU_SOURCE /* required for memfd_create() and fallocate() */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <wayland-util.h>
@@ -11,12 +16,44 @@
 #include "fourcc.h"
 #include "log.h"
 
-/* Defined in src/allocators/common.c */
-void base_buffer_common_init(struct base_buffer *buffer);
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+#define HUGE_PAGE_SIZE (2u << 20)
+#ifndef MFD_HUGE_2MB
+	#define MFD_HUGE_2MB (21u << 26)
+#endif
+
+struct shm_slab_range {
+	uint32_t offset;
+	uint32_t size;
+	struct wl_list link;
+};
+
+struct shm_slab {
+	struct base_shm_slab base;
+	/* Alignment of buffers within the slab */
+	uint32_t page_size;
+	/* enum base_buffer_backing_flags */
+	uint32_t backing;
+	uint32_t buffer_count;
+	/* struct shm_slab_range, sorted by offset */
+	struct wl_list free_ranges;
+};
+
+struct shm_slab_attachment {
+	void *key;
+	void *value;
+	slab_attachment_destroy_func_t destroy_cb;
+};
 
 struct shm_allocator {
 	struct base_allocator base;
-	struct wl_list buffers;
+	struct base_buffer_pool pool;
+	uint32_t flags;
+	/* Only used with SHM_ALLOCATOR_SLAB */
+	struct shm_slab *slab;
 };
 
 struct shm_allocator_buffer {
@@ -24,98 +61,498 @@ struct shm_allocator_buffer {
 
 	int fd;
 	uint32_t byte_size;
+	/* Offset into fd, always 0 unless allocated from a slab */
+	uint32_t offset;
+	/* Length of the mapping, byte_size aligned to the page size of the backing */
+	uint32_t map_size;
+	/* Pages beyond this have been given back to the kernel, see buffer_release_slack() */
+	uint32_t committed_size;
+	/* All pages have been given back to the kernel, see buffer_release_pages() */
+	bool pages_released;
 	struct shm_allocator *allocator;
+	/*
+	 * Persistent mapping of the buffer, created on the first
+	 * get_pixels() call and kept until the buffer is destroyed.
+	 */
+	void *data;
 };
 
+static bool thp_shmem_mode_allows;
+
+static void
+thp_shmem_read_mode(void)
+{
+	char mode[128] = { 0 };
+	FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+	if (file) {
+		if (fgets(mode, sizeof(mode), file)) {
+			/* The active mode is in brackets, e.g. "always within_size [advise] never deny force" */
+			thp_shmem_mode_allows = !strstr(mode, "[never]") && !strstr(mode, "[deny]");
+		}
+		fclose(file);
+	}
+}
+
+/* Called from get_pixels(), which may run on several threads at once */
+static bool
+thp_shmem_available(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, thp_shmem_read_mode);
+	return thp_shmem_mode_allows;
+}
+
+static int
+hugetlb_memfd_create(const char *name, uint32_t size)
+{
+	int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB | MFD_HUGE_2MB);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	/*
+	 * Huge pages are reserved when mapping the memfd, probe that now
+	 * rather than failing later on when the buffer is already in use.
+	 */
+	void *probe = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (probe == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	munmap(probe, size);
+	return fd;
+}
+
+/*
+ * Creates a memfd of at least *size bytes and records the backing.
+ * *size may be rounded up to the huge page size.
+ */
+static int
+shm_memfd_create(const char *name, uint32_t flags, uint32_t *size, uint32_t *backing)
+{
+	int fd = -1;
+	*backing = 0;
+	if (flags & SHM_ALLOCATOR_HUGEPAGES) {
+		const uint32_t huge_size = ALIGN(*size, HUGE_PAGE_SIZE);
+		if (huge_size >= *size) {
+			fd = hugetlb_memfd_create(name, huge_size);
+		}
+		if (fd >= 0) {
+			*size = huge_size;
+			*backing |= BASE_BUFFER_BACKING_HUGETLB;
+		} else {
+			/* No (free) huge pages configured, madvise() THP in buffer_get_pixels() instead */
+			fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		}
+	} else {
+		fd = memfd_create(name, MFD_CLOEXEC);
+	}
+	if (fd < 0) {
+		return -1;
+	}
+	if (!(*backing & BASE_BUFFER_BACKING_HUGETLB) && ftruncate(fd, *size) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (flags & SHM_ALLOCATOR_HUGEPAGES) {
+		if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+			*backing |= BASE_BUFFER_BACKING_SEALED;
+		} else {
+			perror("Failed to seal memfd");
+		}
+	}
+	return fd;
+}
+
+void *
+base_shm_slab_get_attachment(struct base_shm_slab *slab, void *key)
+{
+	struct shm_slab_attachment *att;
+	wl_array_for_each(att, &slab->attachments) {
+		if (att->key == key) {
+			return att->value;
+		}
+	}
+	return NULL;
+}
+
+void
+base_shm_slab_set_attachment(struct base_shm_slab *slab, void *key, void *value,
+		slab_attachment_destroy_func_t destroy_cb)
+{
+	struct shm_slab_attachment *att;
+	wl_array_for_each(att, &slab->attachments) {
+		if (att->key == key) {
+			att->value = value;
+			att->destroy_cb = destroy_cb;
+			return;
+		}
+	}
+	att = wl_array_add(&slab->attachments, sizeof(*att));
+	assert(att);
+	*att = (struct shm_slab_attachment) {
+		.key = key,
+		.value = value,
+		.destroy_cb = destroy_cb,
+	};
+}
+
+static void
+slab_insert_free_range(struct shm_slab *slab, uint32_t offset, uint32_t size)
+{
+	/* Find the first range behind the new one */
+	struct shm_slab_range *next;
+	wl_list_for_each(next, &slab->free_ranges, link) {
+		if (next->offset > offset) {
+			break;
+		}
+	}
+	struct shm_slab_range *prev = wl_container_of(next->link.prev, prev, link);
+	const bool has_next = &next->link != &slab->free_ranges;
+	const bool has_prev = &prev->link != &slab->free_ranges;
+
+	if (has_prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		if (has_next && prev->offset + prev->size == next->offset) {
+			prev->size += next->size;
+			wl_list_remove(&next->link);
+			free(next);
+		}
+		return;
+	}
+	if (has_next && offset + size == next->offset) {
+		next->offset = offset;
+		next->size += size;
+		return;
+	}
+	struct shm_slab_range *range = calloc(1, sizeof(*range));
+	assert(range);
+	range->offset = offset;
+	range->size = size;
+	wl_list_insert(next->link.prev, &range->link);
+}
+
+static struct shm_slab *
+slab_create(uint32_t flags)
+{
+	struct shm_slab *slab = calloc(1, sizeof(*slab));
+	assert(slab);
+
+	/* Huge page backed slabs start with a single huge page to probe for availability */
+	uint32_t size = (flags & SHM_ALLOCATOR_HUGEPAGES) ? HUGE_PAGE_SIZE : 0;
+	slab->base.fd = shm_memfd_create("wayland-shm-slab", flags, &size, &slab->backing);
+	if (slab->base.fd < 0) {
+		perror("Failed to create SHM slab");
+		free(slab);
+		return NULL;
+	}
+	/* Keep buffers huge page aligned for THP as well, so they can be mapped via PMDs */
+	slab->page_size = (flags & SHM_ALLOCATOR_HUGEPAGES) ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+	wl_array_init(&slab->base.attachments);
+	wl_list_init(&slab->free_ranges);
+	if (size) {
+		slab->base.size = size;
+		slab_insert_free_range(slab, 0, size);
+	}
+	return slab;
+}
+
+static void
+slab_destroy(struct shm_slab *slab)
+{
+	struct shm_slab_attachment *att;
+	wl_array_for_each(att, &slab->base.attachments) {
+		if (att->destroy_cb) {
+			att->destroy_cb(&slab->base, att->key, att->value);
+		}
+	}
+	wl_array_release(&slab->base.attachments);
+
+	struct shm_slab_range *range, *tmp;
+	wl_list_for_each_safe(range, tmp, &slab->free_ranges, link) {
+		wl_list_remove(&range->link);
+		free(range);
+	}
+	close(slab->base.fd);
+	free(slab);
+}
+
+static bool
+slab_grow(struct shm_slab *slab, uint32_t size)
+{
+	/* A free range at the very end of the slab can be extended in place */
+	uint32_t tail_size = 0;
+	if (!wl_list_empty(&slab->free_ranges)) {
+		struct shm_slab_range *tail = wl_container_of(slab->free_ranges.prev, tail, link);
+		if (tail->offset + tail->size == slab->base.size) {
+			tail_size = tail->size;
+		}
+	}
+
+	/* Grow geometrically to keep the number of wl_shm_pool.resize requests low */
+	const uint64_t grow_by = MAX(size - tail_size, slab->base.size / 2);
+	const uint64_t new_size = ALIGN((uint64_t)slab->base.size + grow_by, (uint64_t)slab->page_size);
+	if (new_size > INT32_MAX) {
+		log("SHM slab can't grow beyond %d bytes", INT32_MAX);
+		return false;
+	}
+	if (ftruncate(slab->base.fd, new_size) < 0) {
+		perror("Failed to grow SHM slab");
+		return false;
+	}
+	const uint32_t old_size = slab->base.size;
+	slab->base.size = new_size;
+	slab_insert_free_range(slab, old_size, new_size - old_size);
+	return true;
+}
+
+static bool
+slab_alloc(struct shm_slab *slab, uint32_t size, uint32_t *offset)
+{
+	size = ALIGN(size, slab->page_size);
+	for (int attempt = 0; attempt < 2; attempt++) {
+		/* First fit */
+		struct shm_slab_range *range;
+		wl_list_for_each(range, &slab->free_ranges, link) {
+			if (range->size < size) {
+				continue;
+			}
+			*offset = range->offset;
+			range->offset += size;
+			range->size -= size;
+			if (!range->size) {
+				wl_list_remove(&range->link);
+				free(range);
+			}
+			slab->buffer_count++;
+			return true;
+		}
+		if (attempt || !slab_grow(slab, size)) {
+			break;
+		}
+	}
+	return false;
+}
+
+static void
+slab_free(struct shm_slab *slab, uint32_t offset, uint32_t size)
+{
+	size = ALIGN(size, slab->page_size);
+	assert(slab->buffer_count);
+	slab->buffer_count--;
+
+	/* The memfd can't shrink while the compositor has it mapped, so just drop the pages */
+	if (fallocate(slab->base.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) < 0) {
+		perror("Failed to release SHM slab range");
+	}
+	slab_insert_free_range(slab, offset, size);
+}
+
 static void *
 buffer_get_pixels(struct base_buffer *buffer, uint32_t access)
 {
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	int flags = 0;
-	if (access & BASE_ALLOCATOR_REQ_READ) {
-		flags |= PROT_READ;
+	if (!shm_buffer->data) {
+		/*
+		 * Always map RDWR so the mapping can be reused for any
+		 * later access, independent of the one requested now.
+		 * Buffers the CPU is about to fill or read are prefaulted in one go.
+		 */
+		const int map_flags = buffer->usage & BASE_BUFFER_USAGE_CPU
+			? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+		void *data = mmap(NULL, shm_buffer->map_size, PROT_READ | PROT_WRITE,
+			map_flags, shm_buffer->fd, shm_buffer->offset);
+		if (!data || data == MAP_FAILED) {
+			perror("Failed to map SHM buffer");
+			return NULL;
+		}
+		BUFFER_LOG(true, buffer, "Mapped %u bytes", shm_buffer->map_size);
+		base_buffer_pool_count_map(&shm_buffer->allocator->pool, buffer);
+		shm_buffer->data = data;
+		buffer->backing |= BASE_BUFFER_BACKING_PERSISTENT_MAP;
+
+		const uint32_t flags = shm_buffer->allocator->flags;
+		if ((flags & SHM_ALLOCATOR_HUGEPAGES)
+				&& !(buffer->backing & BASE_BUFFER_BACKING_HUGETLB)
+				&& shm_buffer->map_size >= HUGE_PAGE_SIZE
+				&& thp_shmem_available()
+				&& madvise(data, shm_buffer->map_size, MADV_HUGEPAGE) == 0) {
+			buffer->backing |= BASE_BUFFER_BACKING_THP;
+		}
 	}
 	if (access & BASE_ALLOCATOR_REQ_WRITE) {
-		flags |= PROT_WRITE;
-	}
-	void *pixels = mmap(NULL, shm_buffer->byte_size, flags,
-		MAP_SHARED, shm_buffer->fd, /*offset*/0);
-	if (!pixels || pixels == MAP_FAILED) {
-		perror("Failed to map SHM buffer");
-		return NULL;
-	}
-	if (flags & PROT_WRITE) {
 		buffer->serial++;
 	}
-	return pixels;
+	shm_buffer->pages_released = false;
+	return shm_buffer->data;
 }
 
 static void
 buffer_get_pixels_end(struct base_buffer *buffer, void *pixels)
 {
+	/* The mapping stays alive until buffer_destroy() */
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	munmap(pixels, shm_buffer->byte_size);
+	assert(pixels == shm_buffer->data);
 }
 
 static void
 buffer_lock(struct base_buffer *buffer)
 {
-	buffer->locks++;
+	if (!atomic_fetch_add(&buffer->locks, 1)) {
+		struct shm_allocator_buffer *shm_buffer = (void *)buffer;
+		base_buffer_pool_acquire(&shm_buffer->allocator->pool, buffer);
+	}
 }
 
 static void
 buffer_destroy(struct base_buffer *buffer)
 {
 	assert(!buffer->locks);
-	buffer->destroy_attachments(buffer);
-	wl_list_remove(&buffer->link);
+	buffer->impl->destroy_attachments(buffer);
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	close(shm_buffer->fd);
+	base_buffer_pool_remove(&shm_buffer->allocator->pool, buffer);
+	if (shm_buffer->data) {
+		munmap(shm_buffer->data, shm_buffer->map_size);
+	}
+	struct shm_slab *slab = shm_buffer->allocator->slab;
+	if (slab) {
+		base_buffer_pool_lock(&shm_buffer->allocator->pool);
+		slab_free(slab, shm_buffer->offset, shm_buffer->byte_size);
+		base_buffer_pool_unlock(&shm_buffer->allocator->pool);
+	} else {
+		close(shm_buffer->fd);
+	}
 	free(shm_buffer);
 }
 
 static void
 buffer_unlock(struct base_buffer *buffer)
 {
-	assert(buffer->locks >= 1);
-	buffer->locks--;
+	const int locks = atomic_fetch_sub(&buffer->locks, 1);
+	assert(locks >= 1);
 
-	if (buffer->locks) {
+	if (locks > 1) {
 		return;
 	}
 
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	base_buffer_pool_cleanup(&shm_buffer->allocator->buffers);
+	base_buffer_pool_release(&shm_buffer->allocator->pool, buffer);
 }
 
 static bool
 buffer_is_exact_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
 {
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	const uint32_t b_size = fourcc_get_stride(fourcc, width) * height;
+	const uint32_t b_size = fourcc_get_aligned_plane_layout(fourcc, width, height,
+		buffer->stride_align, NULL, NULL);
 
 	return buffer->width == width && buffer->height == height
 		&& buffer->fourcc == fourcc && buffer->modifier == modifier
 		&& shm_buffer->byte_size == b_size;
 }
 
+static void
+buffer_update_planes(struct shm_allocator_buffer *shm_buffer)
+{
+	struct base_buffer *buffer = &shm_buffer->base;
+	uint32_t strides[FOURCC_MAX_PLANES] = { 0 };
+	uint32_t offsets[FOURCC_MAX_PLANES] = { 0 };
+	fourcc_get_aligned_plane_layout(buffer->fourcc, buffer->width, buffer->height,
+		buffer->stride_align, strides, offsets);
+
+	buffer->stride = strides[0];
+	buffer->plane_count = fourcc_get_plane_count(buffer->fourcc);
+	for (uint32_t i = 0; i < buffer->plane_count; i++) {
+		buffer->planes[i] = (struct base_buffer_plane) {
+			.fd = shm_buffer->fd,
+			.offset = shm_buffer->offset + offsets[i],
+			.stride = strides[i],
+		};
+	}
+}
+
+static uint32_t
+buffer_page_size(struct shm_allocator_buffer *shm_buffer)
+{
+	struct shm_slab *slab = shm_buffer->allocator->slab;
+	if (slab) {
+		return slab->page_size;
+	}
+	return sysconf(_SC_PAGESIZE);
+}
+
+static void
+buffer_release_slack(struct shm_allocator_buffer *shm_buffer, uint32_t used_size)
+{
+	/*
+	 * The size of the memfd has to stay the same as the compositor may still
+	 * have it mapped, the pages will come back once the tail is written again.
+	 * Not for hugetlbfs, punching a hole gives up the huge page reservation
+	 * and writing the tail again SIGBUSes once the huge page pool is empty.
+	 */
+	if (shm_buffer->base.backing & BASE_BUFFER_BACKING_HUGETLB) {
+		shm_buffer->committed_size = shm_buffer->map_size;
+		return;
+	}
+	const uint32_t committed_size = ALIGN(used_size, buffer_page_size(shm_buffer));
+	if (committed_size < shm_buffer->committed_size) {
+		const uint32_t len = shm_buffer->committed_size - committed_size;
+		if (fallocate(shm_buffer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				shm_buffer->offset + committed_size, len) < 0) {
+			perror("Failed to release unused SHM buffer pages");
+			return;
+		}
+		BUFFER_LOG(true, shm_buffer, "Released %u unused bytes", len);
+	}
+	shm_buffer->committed_size = MIN(committed_size, shm_buffer->map_size);
+}
+
 static bool
 buffer_is_close_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
 {
 	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
-	const uint32_t b_size = fourcc_get_stride(fourcc, width) * height;
+	const uint32_t b_size = fourcc_get_aligned_plane_layout(fourcc, width, height,
+		buffer->stride_align, NULL, NULL);
 
 	/* Hrm. modifying the buffer here is kind of a weird side effect */
 	if (shm_buffer->byte_size >= b_size) {
 		buffer->width = width;
 		buffer->height = height;
+		buffer->alloc_width = width;
+		buffer->alloc_height = height;
 		buffer->fourcc = fourcc;
-		buffer->stride = fourcc_get_stride(fourcc, width);
+		buffer_update_planes(shm_buffer);
+		buffer_release_slack(shm_buffer, b_size);
 		return true;
 	}
 	return false;
 }
 
+static uint64_t
+buffer_release_pages(struct base_buffer *buffer)
+{
+	/* Only called for unlocked buffers, so nobody cares about the contents anymore */
+	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
+	/*
+	 * Huge pages go back to the persistent pool and not to the system,
+	 * and losing the reservation can SIGBUS on reuse. See buffer_release_slack().
+	 */
+	if (shm_buffer->pages_released || (buffer->backing & BASE_BUFFER_BACKING_HUGETLB)) {
+		return 0;
+	}
+	if (fallocate(shm_buffer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			shm_buffer->offset, shm_buffer->map_size) < 0) {
+		perror("Failed to release SHM buffer pages");
+		return 0;
+	}
+	BUFFER_LOG(true, buffer, "Released %u bytes", shm_buffer->committed_size);
+	shm_buffer->pages_released = true;
+	return shm_buffer->committed_size;
+}
+
 static uint32_t
 buffer_get_byte_size(struct base_buffer *buffer)
 {
@@ -130,11 +567,54 @@ buffer_get_fd(struct base_buffer *buffer)
 	return shm_buffer->fd;
 }
 
+static struct base_shm_slab *
+buffer_get_shm_slab(struct base_buffer *buffer, uint32_t *offset)
+{
+	struct shm_allocator_buffer *shm_buffer = (void *)buffer;
+	struct shm_slab *slab = shm_buffer->allocator->slab;
+	if (!slab) {
+		return NULL;
+	}
+	*offset = shm_buffer->offset;
+	return &slab->base;
+}
+
+static const struct base_buffer_impl buffer_impl = {
+	.get_pixels = buffer_get_pixels,
+	.get_pixels_end = buffer_get_pixels_end,
+	.get_wl_buffer = base_buffer_common_get_wl_buffer,
+	.lock = buffer_lock,
+	.unlock = buffer_unlock,
+	.mark_dirty = base_buffer_common_mark_dirty,
+	.add_damage = base_buffer_common_add_damage,
+	.get_damage = base_buffer_common_get_damage,
+	.is_idle = base_buffer_common_is_idle,
+	.get_attachment = base_buffer_common_get_attachment,
+	.set_attachment = base_buffer_common_set_attachment,
+
+	/* Internal export helpers */
+	.get_fd = buffer_get_fd,
+	.get_byte_size = buffer_get_byte_size,
+	.get_shm_slab = buffer_get_shm_slab,
+	.release_pages = buffer_release_pages,
+
+	/* Pool support */
+	.is_exact_match = buffer_is_exact_match,
+	.is_close_match = buffer_is_close_match,
+	.destroy = buffer_destroy,
+
+	/* Internal helpers */
+	.destroy_attachments = base_buffer_common_destroy_attachments,
+};
+
 static struct base_buffer *
-alloc_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+alloc_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage)
 {
 	struct shm_allocator *alloc = (void *)allocator;
 	struct shm_allocator_buffer *shm_buffer = NULL;
+	/* Buffers are reshaped on re-use anyway, see buffer_is_close_match() */
+	usage &= ~BASE_BUFFER_USAGE_HINTS;
 
 	if (!fourcc_get_bytes_per_pixel(fourcc)) {
 		log("Failed to parse fourcc format 0x%x", fourcc);
@@ -147,82 +627,128 @@ alloc_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t h
 	}
 
 	shm_buffer = (void *)base_buffer_pool_get_buffer(
-		&alloc->buffers, width, height, fourcc, modifier);
+		&alloc->pool, width, height, fourcc, modifier, usage);
 	if (shm_buffer) {
-		/* Ensure recently used buffers are at the end of the list */
-		struct base_buffer *buffer = &shm_buffer->base;
-		wl_list_remove(&buffer->link);
-		wl_list_insert(alloc->buffers.prev, &buffer->link);
-		return buffer;
+		return &shm_buffer->base;
+	}
+
+	const uint32_t stride_align = base_buffer_pool_get_stride_align(&alloc->pool, usage);
+	const uint32_t byte_size = fourcc_get_aligned_plane_layout(fourcc, width, height,
+		stride_align, NULL, NULL);
+	uint32_t map_size = byte_size;
+	uint32_t backing = 0;
+	uint32_t offset = 0;
+	int fd = -1;
+	if (alloc->slab) {
+		/* The slab is shared by all buffers, serialize on the pool mutex */
+		base_buffer_pool_lock(&alloc->pool);
+		const bool allocated = slab_alloc(alloc->slab, byte_size, &offset);
+		base_buffer_pool_unlock(&alloc->pool);
+		if (!allocated) {
+			return NULL;
+		}
+		fd = alloc->slab->base.fd;
+		backing = alloc->slab->backing;
+		map_size = ALIGN(byte_size, alloc->slab->page_size);
+	} else {
+		/* Small buffers would waste most of a huge page */
+		const uint32_t flags = byte_size >= HUGE_PAGE_SIZE
+			? alloc->flags : alloc->flags & ~SHM_ALLOCATOR_HUGEPAGES;
+		fd = shm_memfd_create("wayland-buffer", flags, &map_size, &backing);
+		assert(fd >= 0);
 	}
 
 	shm_buffer = calloc(1, sizeof(*shm_buffer));
 	assert(shm_buffer);
-	BUFFER_LOG(true, shm_buffer, "Creating new shm buffer with format 0x%08x (modifier 0x%016lx)", fourcc, modifier);
+	BUFFER_LOG(true, shm_buffer, "Creating new shm buffer with format 0x%08x (modifier 0x%016lx, backing 0x%x)", fourcc, modifier, backing);
 	*shm_buffer = (struct shm_allocator_buffer) {
 		.base = {
-			/* API */
-			.get_pixels = buffer_get_pixels,
-			.get_pixels_end = buffer_get_pixels_end,
-			.lock = buffer_lock,
-			.unlock = buffer_unlock,
+			.impl = &buffer_impl,
 
 			/* Props */
 			.caps = allocator->capabilities,
+			.usage = usage,
+			.backing = backing,
 			.width = width,
 			.height = height,
 			.fourcc = fourcc,
 			.modifier = DRM_FORMAT_MOD_LINEAR,
-			.stride = fourcc_get_stride(fourcc, width),
-
-			/* Internal export helpers */
-			.get_fd = buffer_get_fd,
-			.get_byte_size = buffer_get_byte_size,
-
-			/* Pool support */
-			.is_exact_match = buffer_is_exact_match,
-			.is_close_match = buffer_is_close_match,
-			.destroy = buffer_destroy,
+			.stride_align = stride_align,
 		},
 		.allocator = alloc,
-		.fd = memfd_create("wayland-buffer", MFD_CLOEXEC),
-		.byte_size = fourcc_get_stride(fourcc, width) * height,
+		.fd = fd,
+		.offset = offset,
+		.byte_size = byte_size,
+		.map_size = map_size,
+		.committed_size = map_size,
 	};
+	buffer_update_planes(shm_buffer);
 	base_buffer_common_init(&shm_buffer->base);
-
-	assert(shm_buffer->fd >= 0);
-	ftruncate(shm_buffer->fd, shm_buffer->byte_size);
-	wl_list_insert(alloc->buffers.prev, &shm_buffer->base.link);
+	base_buffer_pool_add(&alloc->pool, &shm_buffer->base);
 
 	return &shm_buffer->base;
 }
 
+static void
+alloc_set_policy(struct base_allocator *allocator, const struct base_buffer_pool_policy *policy)
+{
+	struct shm_allocator *alloc = (void *)allocator;
+	base_buffer_pool_set_policy(&alloc->pool, policy);
+}
+
 static void
 alloc_destroy(struct base_allocator *allocator)
 {
 	struct shm_allocator *alloc = (void *)allocator;
 
 	struct base_buffer *buffer, *tmp;
-	wl_list_for_each_safe(buffer, tmp, &alloc->buffers, link) {
+	wl_list_for_each_safe(buffer, tmp, &alloc->pool.buffers, link) {
 		if (buffer->locks) {
 			log("Warning: locked buffer found in destroying shm_allocator");
 		} else {
-			buffer->destroy(buffer);
+			buffer->impl->destroy(buffer);
 		}
 	}
+	if (alloc->slab) {
+		if (alloc->slab->buffer_count) {
+			/* Locked buffers still reference the slab */
+			log("Warning: leaking SHM slab with %u remaining buffers", alloc->slab->buffer_count);
+		} else {
+			slab_destroy(alloc->slab);
+		}
+	}
+	base_buffer_pool_finish(&alloc->pool);
 	free(allocator);
 }
 
 struct base_allocator *
-shm_allocator_create(void)
+shm_allocator_create_with_flags(uint32_t flags)
 {
 	struct shm_allocator *alloc = calloc(1, sizeof(*alloc));
 	assert(alloc);
 	alloc->base = (struct base_allocator) {
 		.create_buffer = alloc_create_buffer,
+		.create_buffer_from_list = base_allocator_common_create_buffer_from_list,
+		.reserve = base_allocator_common_reserve,
+		.set_policy = alloc_set_policy,
 		.destroy = alloc_destroy,
 		.capabilities = BASE_ALLOCATOR_CAP_CPU_ACCESS | BASE_ALLOCATOR_CAP_EXPORT_SHM,
+		.pool = &alloc->pool,
 	};
-	wl_list_init(&alloc->buffers);
+	alloc->flags = flags;
+	if (flags & SHM_ALLOCATOR_SLAB) {
+		alloc->slab = slab_create(flags);
+		if (!alloc->slab) {
+			free(alloc);
+			return NULL;
+		}
+	}
+	base_buffer_pool_init(&alloc->pool);
 	return &alloc->base;
 }
+
+struct base_allocator *
+shm_allocator_create(void)
+{
+	return shm_allocator_create_with_flags(0);
+}
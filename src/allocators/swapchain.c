@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "fourcc.h"
+#include "log.h"
+#include "swapchain.h"
+
+static bool
+slot_is_free(struct base_swapchain_slot *slot)
+{
+	/* The only lock left is our own */
+	return !slot->acquired && (!slot->buffer || slot->buffer->locks == 1);
+}
+
+static bool
+slot_is_outdated(struct base_swapchain *swapchain, struct base_swapchain_slot *slot)
+{
+	return slot->buffer && (slot->buffer->width != swapchain->width
+		|| slot->buffer->height != swapchain->height);
+}
+
+static void
+slot_release(struct base_swapchain_slot *slot)
+{
+	if (slot->buffer) {
+		slot->buffer->impl->unlock(slot->buffer);
+		slot->buffer = NULL;
+	}
+	slot->presented = 0;
+}
+
+static struct base_buffer *
+swapchain_acquire(struct base_swapchain *swapchain)
+{
+	/*
+	 * Prefer the least recently presented buffer which already exists
+	 * and only allocate a new one if all existing ones are in use.
+	 */
+	struct base_swapchain_slot *slot = NULL;
+	for (uint32_t i = 0; i < swapchain->depth; i++) {
+		struct base_swapchain_slot *candidate = &swapchain->slots[i];
+		if (!slot_is_free(candidate)) {
+			continue;
+		}
+		if (!slot || (!slot->buffer && candidate->buffer)
+				|| (slot->buffer && candidate->buffer
+					&& candidate->presented < slot->presented)) {
+			slot = candidate;
+		}
+	}
+	if (!slot) {
+		swapchain->starved_count++;
+		struct base_buffer_pool *pool = swapchain->allocator->pool;
+		base_buffer_pool_count_starvation(pool, fourcc_get_aligned_plane_layout(
+			swapchain->fourcc, swapchain->width, swapchain->height,
+			base_buffer_pool_get_stride_align(pool, swapchain->usage), NULL, NULL));
+		log("Swapchain %p starved, all %u buffers are in use", swapchain, swapchain->depth);
+		return NULL;
+	}
+
+	if (slot_is_outdated(swapchain, slot)) {
+		slot_release(slot);
+	}
+	const uint32_t age = slot->buffer && slot->presented
+		? swapchain->frame - slot->presented + 1 : 0;
+	if (!slot->buffer) {
+		uint32_t usage = swapchain->usage;
+		if (swapchain->resizing) {
+			usage |= BASE_BUFFER_USAGE_HINT_RESIZING;
+		}
+		struct base_allocator *allocator = swapchain->allocator;
+		slot->buffer = allocator->create_buffer(allocator, swapchain->width, swapchain->height,
+			swapchain->fourcc, swapchain->modifier, usage);
+		if (!slot->buffer) {
+			log("Swapchain %p failed to allocate a %ux%u buffer", swapchain,
+				swapchain->width, swapchain->height);
+			return NULL;
+		}
+		slot->buffer->impl->lock(slot->buffer);
+	}
+	slot->buffer->age = age;
+	slot->acquired = true;
+	return slot->buffer;
+}
+
+static void
+swapchain_get_damage(struct base_swapchain *swapchain, struct base_buffer *buffer, struct base_rect *damage)
+{
+	/* The buffer is missing the changes of every frame presented after it */
+	const uint32_t missed = buffer->age ? buffer->age - 1 : UINT32_MAX;
+	if (missed > BASE_SWAPCHAIN_MAX_DEPTH || missed > swapchain->frame) {
+		*damage = (struct base_rect) { 0, 0, buffer->width, buffer->height };
+		return;
+	}
+	*damage = (struct base_rect) { 0 };
+	for (uint32_t i = 0; i < missed; i++) {
+		const uint64_t frame = swapchain->frame - i;
+		base_rect_union(damage, &swapchain->damage[frame % BASE_SWAPCHAIN_MAX_DEPTH]);
+	}
+}
+
+static void
+swapchain_present(struct base_swapchain *swapchain, struct base_buffer *buffer, const struct base_rect *damage)
+{
+	for (uint32_t i = 0; i < swapchain->depth; i++) {
+		struct base_swapchain_slot *slot = &swapchain->slots[i];
+		if (slot->buffer == buffer) {
+			assert(slot->acquired);
+			slot->acquired = false;
+			slot->presented = ++swapchain->frame;
+			/* The size settled, allocate exactly again */
+			if (buffer->width == swapchain->presented_width
+					&& buffer->height == swapchain->presented_height) {
+				swapchain->resizing = false;
+			}
+			swapchain->presented_width = buffer->width;
+			swapchain->presented_height = buffer->height;
+			swapchain->damage[swapchain->frame % BASE_SWAPCHAIN_MAX_DEPTH] = damage ? *damage
+				: (struct base_rect) { 0, 0, buffer->width, buffer->height };
+			return;
+		}
+	}
+	log("Buffer %p presented to swapchain %p is not part of it", buffer, swapchain);
+}
+
+static void
+swapchain_resize(struct base_swapchain *swapchain, uint32_t width, uint32_t height)
+{
+	if (swapchain->width == width && swapchain->height == height) {
+		return;
+	}
+	swapchain->width = width;
+	swapchain->height = height;
+	/* Until the first frame this is just the initial size */
+	if (swapchain->frame) {
+		swapchain->resizing = true;
+	}
+
+	/* Buffers still in use are replaced in acquire() once they are released */
+	for (uint32_t i = 0; i < swapchain->depth; i++) {
+		struct base_swapchain_slot *slot = &swapchain->slots[i];
+		if (slot_is_free(slot) && slot_is_outdated(swapchain, slot)) {
+			slot_release(slot);
+		}
+	}
+}
+
+static void
+swapchain_destroy(struct base_swapchain *swapchain)
+{
+	/* Buffers still in use by the consumer go back to the allocator once released */
+	for (uint32_t i = 0; i < swapchain->depth; i++) {
+		struct base_swapchain_slot *slot = &swapchain->slots[i];
+		if (slot->acquired) {
+			log("Warning: destroying swapchain %p with acquired buffer %p", swapchain, slot->buffer);
+		}
+		slot_release(slot);
+	}
+	free(swapchain);
+}
+
+struct base_swapchain *
+base_swapchain_create(struct base_allocator *allocator, uint32_t depth,
+		uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	if (!depth || depth > BASE_SWAPCHAIN_MAX_DEPTH) {
+		log("Invalid swapchain depth %u, supported are 1 to %u", depth, BASE_SWAPCHAIN_MAX_DEPTH);
+		return NULL;
+	}
+
+	struct base_swapchain *swapchain = calloc(1, sizeof(*swapchain));
+	assert(swapchain);
+	*swapchain = (struct base_swapchain) {
+		.acquire = swapchain_acquire,
+		.get_damage = swapchain_get_damage,
+		.present = swapchain_present,
+		.resize = swapchain_resize,
+		.destroy = swapchain_destroy,
+		.width = width,
+		.height = height,
+		.fourcc = fourcc,
+		.modifier = modifier,
+		.usage = usage,
+		.depth = depth,
+		.allocator = allocator,
+	};
+	return swapchain;
+}
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE /* required for memfd_create() */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-util.h>
+
+#include "base.h"
+#include "buffer.h"
+#include "fourcc.h"
+#include "log.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/* Common pitch requirement of display engines, the minimum even if the pool policy asks for less */
+#define UDMABUF_STRIDE_ALIGN 64
+
+struct udmabuf_allocator {
+	struct base_allocator base;
+	int udmabuf_fd;
+	struct base_buffer_pool pool;
+};
+
+struct udmabuf_allocator_buffer {
+	struct base_buffer base;
+
+	/* dmabuf created from memfd, both refer to the same pages */
+	int fd;
+	int memfd;
+	uint32_t byte_size;
+	struct udmabuf_allocator *allocator;
+	/*
+	 * Persistent mapping of the memfd, created on the first
+	 * get_pixels() call and kept until the buffer is destroyed.
+	 */
+	void *data;
+	/* Access of the current get_pixels(), for DMA_BUF_IOCTL_SYNC */
+	uint32_t cpu_access;
+};
+
+static uint32_t
+get_stride(uint32_t fourcc, uint32_t width, uint32_t align)
+{
+	return fourcc_get_aligned_stride(fourcc, width, align);
+}
+
+static void *
+buffer_get_pixels(struct base_buffer *buffer, uint32_t access)
+{
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	if (!udmabuf_buffer->data) {
+		/* Buffers the CPU is about to fill or read are prefaulted in one go */
+		const int map_flags = buffer->usage & BASE_BUFFER_USAGE_CPU
+			? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+		void *data = mmap(NULL, udmabuf_buffer->byte_size, PROT_READ | PROT_WRITE,
+			map_flags, udmabuf_buffer->memfd, 0);
+		if (!data || data == MAP_FAILED) {
+			perror("Failed to map udmabuf buffer");
+			return NULL;
+		}
+		BUFFER_LOG(true, buffer, "Mapped %u bytes", udmabuf_buffer->byte_size);
+		base_buffer_pool_count_map(&udmabuf_buffer->allocator->pool, buffer);
+		udmabuf_buffer->data = data;
+		buffer->backing |= BASE_BUFFER_BACKING_PERSISTENT_MAP;
+	}
+	assert(!udmabuf_buffer->cpu_access);
+	base_dmabuf_begin_cpu_access(udmabuf_buffer->fd, access);
+	udmabuf_buffer->cpu_access = access;
+	if (access & BASE_ALLOCATOR_REQ_WRITE) {
+		buffer->serial++;
+	}
+	return udmabuf_buffer->data;
+}
+
+static void
+buffer_get_pixels_end(struct base_buffer *buffer, void *pixels)
+{
+	/* The mapping stays alive until buffer_destroy() */
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	assert(pixels == udmabuf_buffer->data);
+	base_dmabuf_end_cpu_access(udmabuf_buffer->fd, udmabuf_buffer->cpu_access);
+	udmabuf_buffer->cpu_access = 0;
+}
+
+static void
+buffer_lock(struct base_buffer *buffer)
+{
+	if (!atomic_fetch_add(&buffer->locks, 1)) {
+		struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+		base_buffer_pool_acquire(&udmabuf_buffer->allocator->pool, buffer);
+	}
+}
+
+static void
+buffer_destroy(struct base_buffer *buffer)
+{
+	assert(!buffer->locks);
+	buffer->impl->destroy_attachments(buffer);
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	base_buffer_pool_remove(&udmabuf_buffer->allocator->pool, buffer);
+	if (udmabuf_buffer->data) {
+		munmap(udmabuf_buffer->data, udmabuf_buffer->byte_size);
+	}
+	close(udmabuf_buffer->fd);
+	close(udmabuf_buffer->memfd);
+	free(udmabuf_buffer);
+}
+
+static void
+buffer_unlock(struct base_buffer *buffer)
+{
+	const int locks = atomic_fetch_sub(&buffer->locks, 1);
+	assert(locks >= 1);
+
+	if (locks > 1) {
+		return;
+	}
+
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	base_buffer_pool_release(&udmabuf_buffer->allocator->pool, buffer);
+}
+
+static bool
+buffer_is_exact_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+{
+	return buffer->width == width && buffer->height == height
+		&& buffer->fourcc == fourcc && buffer->modifier == modifier;
+}
+
+static bool
+buffer_is_close_match(struct base_buffer *buffer, uint32_t width, uint32_t height, uint32_t fourcc, uint64_t modifier)
+{
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	const uint32_t stride = get_stride(fourcc, width, buffer->stride_align);
+
+	/*
+	 * Same side effect as the SHM allocator. Unlike there, the unused tail
+	 * can't be given back to the kernel as udmabuf keeps the pages pinned.
+	 */
+	if (modifier == DRM_FORMAT_MOD_LINEAR && fourcc_get_plane_count(fourcc) == 1
+			&& udmabuf_buffer->byte_size >= stride * height) {
+		buffer->width = width;
+		buffer->height = height;
+		buffer->alloc_width = width;
+		buffer->alloc_height = height;
+		buffer->fourcc = fourcc;
+		buffer->stride = stride;
+		buffer->planes[0].stride = stride;
+		return true;
+	}
+	return false;
+}
+
+static uint32_t
+buffer_get_byte_size(struct base_buffer *buffer)
+{
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	return udmabuf_buffer->byte_size;
+}
+
+static int
+buffer_get_fd(struct base_buffer *buffer)
+{
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	return udmabuf_buffer->fd;
+}
+
+static int
+buffer_get_shm_fd(struct base_buffer *buffer)
+{
+	struct udmabuf_allocator_buffer *udmabuf_buffer = (void *)buffer;
+	return udmabuf_buffer->memfd;
+}
+
+static const struct base_buffer_impl buffer_impl = {
+	.get_pixels = buffer_get_pixels,
+	.get_pixels_end = buffer_get_pixels_end,
+	.get_wl_buffer = base_buffer_common_get_wl_buffer,
+	.lock = buffer_lock,
+	.unlock = buffer_unlock,
+	.mark_dirty = base_buffer_common_mark_dirty,
+	.add_damage = base_buffer_common_add_damage,
+	.get_damage = base_buffer_common_get_damage,
+	.is_idle = base_buffer_common_is_idle,
+	.get_attachment = base_buffer_common_get_attachment,
+	.set_attachment = base_buffer_common_set_attachment,
+
+	/* Internal export helpers */
+	.get_fd = buffer_get_fd,
+	.get_shm_fd = buffer_get_shm_fd,
+	.get_byte_size = buffer_get_byte_size,
+
+	/* Pool support */
+	.is_exact_match = buffer_is_exact_match,
+	.is_close_match = buffer_is_close_match,
+	.destroy = buffer_destroy,
+
+	/* Internal helpers */
+	.destroy_attachments = base_buffer_common_destroy_attachments,
+};
+
+static struct base_buffer *
+allocator_create_buffer(struct base_allocator *allocator, uint32_t width, uint32_t height,
+		uint32_t fourcc, uint64_t modifier, uint32_t usage)
+{
+	struct udmabuf_allocator *alloc = (void *)allocator;
+	usage &= ~BASE_BUFFER_USAGE_HINTS;
+
+	uint32_t stride_align = base_buffer_pool_get_stride_align(&alloc->pool, usage);
+	if (stride_align < UDMABUF_STRIDE_ALIGN) {
+		stride_align = UDMABUF_STRIDE_ALIGN;
+	}
+	const uint32_t stride = get_stride(fourcc, width, stride_align);
+	if (!stride) {
+		log("Failed to parse fourcc format 0x%x", fourcc);
+		return NULL;
+	}
+
+	if (modifier != DRM_FORMAT_MOD_LINEAR) {
+		log("udmabuf allocator only supports DRM_FORMAT_MOD_LINEAR modifier");
+		return NULL;
+	}
+
+	if (fourcc_get_plane_count(fourcc) != 1) {
+		log("udmabuf allocator only supports single plane formats");
+		return NULL;
+	}
+
+	struct base_buffer *buffer = base_buffer_pool_get_buffer(
+		&alloc->pool, width, height, fourcc, modifier, usage);
+	if (buffer) {
+		return buffer;
+	}
+
+	/* udmabuf requires page aligned, shrink sealed memfds */
+	const uint32_t byte_size = ALIGN(stride * height, (uint32_t)sysconf(_SC_PAGESIZE));
+	int memfd = memfd_create("wayland-udmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		perror("Failed to create memfd");
+		return NULL;
+	}
+	if (ftruncate(memfd, byte_size) < 0) {
+		perror("Failed to resize memfd");
+		close(memfd);
+		return NULL;
+	}
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+		perror("Failed to seal memfd");
+		close(memfd);
+		return NULL;
+	}
+
+	struct udmabuf_create create = {
+		.memfd = memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size = byte_size,
+	};
+	int fd = ioctl(alloc->udmabuf_fd, UDMABUF_CREATE, &create);
+	if (fd < 0) {
+		perror("Failed to create udmabuf");
+		close(memfd);
+		return NULL;
+	}
+
+	struct udmabuf_allocator_buffer *udmabuf_buffer = calloc(1, sizeof(*udmabuf_buffer));
+	assert(udmabuf_buffer);
+	*udmabuf_buffer = (struct udmabuf_allocator_buffer) {
+		.base = {
+			.impl = &buffer_impl,
+
+			/* Props */
+			.caps = allocator->capabilities,
+			.usage = usage,
+			.backing = BASE_BUFFER_BACKING_SEALED,
+			.width = width,
+			.height = height,
+			.fourcc = fourcc,
+			.modifier = DRM_FORMAT_MOD_LINEAR,
+			.stride = stride,
+			.plane_count = 1,
+			.planes = { { .fd = fd, .stride = stride } },
+			.stride_align = stride_align,
+		},
+		.allocator = alloc,
+		.fd = fd,
+		.memfd = memfd,
+		.byte_size = byte_size,
+	};
+	base_buffer_common_init(&udmabuf_buffer->base);
+	base_buffer_pool_add(&alloc->pool, &udmabuf_buffer->base);
+
+	BUFFER_LOG(true, udmabuf_buffer, "Created new udmabuf buffer with format 0x%08x", fourcc);
+	return &udmabuf_buffer->base;
+}
+
+static void
+allocator_set_policy(struct base_allocator *allocator, const struct base_buffer_pool_policy *policy)
+{
+	struct udmabuf_allocator *alloc = (void *)allocator;
+	base_buffer_pool_set_policy(&alloc->pool, policy);
+}
+
+static void
+allocator_destroy(struct base_allocator *allocator)
+{
+	struct udmabuf_allocator *alloc = (void *)allocator;
+
+	struct base_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &alloc->pool.buffers, link) {
+		if (buffer->locks) {
+			log("Warning: locked buffer found in destroying udmabuf_allocator");
+		} else {
+			buffer->impl->destroy(buffer);
+		}
+	}
+	base_buffer_pool_finish(&alloc->pool);
+	close(alloc->udmabuf_fd);
+	free(allocator);
+}
+
+struct base_allocator *
+udmabuf_allocator_create(void)
+{
+	int udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf_fd < 0) {
+		perror("Failed to open /dev/udmabuf");
+		return NULL;
+	}
+
+	struct udmabuf_allocator *alloc = calloc(1, sizeof(*alloc));
+	assert(alloc);
+	*alloc = (struct udmabuf_allocator) {
+		.base = {
+			.create_buffer = allocator_create_buffer,
+			.create_buffer_from_list = base_allocator_common_create_buffer_from_list,
+			.reserve = base_allocator_common_reserve,
+			.set_policy = allocator_set_policy,
+			.destroy = allocator_destroy,
+			.capabilities = BASE_ALLOCATOR_CAP_CPU_ACCESS
+				| BASE_ALLOCATOR_CAP_EXPORT_DMABUF
+				| BASE_ALLOCATOR_CAP_EXPORT_SHM,
+			.pool = &alloc->pool,
+		},
+		.udmabuf_fd = udmabuf_fd,
+	};
+	base_buffer_pool_init(&alloc->pool);
+	return &alloc->base;
+}
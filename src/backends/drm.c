@@ -18,7 +18,8 @@
 
 struct drm_buffer {
 	void (*destroy)(struct drm_buffer *buffer);
-	struct drm *drm;
+	/* Not struct drm, buffers released by drm_destroy() may outlive it */
+	int drm_fd;
 	uint32_t fb_id;
 };
 
@@ -172,7 +173,7 @@ static void
 drm_buffer_destroy(struct drm_buffer *drm_buffer)
 {
 	if (drm_buffer->fb_id) {
-		drmModeCloseFB(drm_buffer->drm->fd, drm_buffer->fb_id);
+		drmModeCloseFB(drm_buffer->drm_fd, drm_buffer->fb_id);
 	}
 	free(drm_buffer);
 }
@@ -185,10 +186,19 @@ drm_import_base_buffer(struct drm *drm, struct base_buffer *buffer)
 		return NULL;
 	}
 
-	uint32_t handle;
-	if (drmPrimeFDToHandle(drm->fd, buffer->get_fd(buffer), &handle) != 0) {
-		perror("Failed to get handle for dmabuf");
-		return NULL;
+	uint32_t handles[4] = { 0 };
+	uint32_t strides[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+	uint64_t modifiers[4] = { 0 };
+	for (uint32_t i = 0; i < buffer->plane_count; i++) {
+		const struct base_buffer_plane *plane = &buffer->planes[i];
+		if (drmPrimeFDToHandle(drm->fd, plane->fd, &handles[i]) != 0) {
+			perror("Failed to get handle for dmabuf");
+			return NULL;
+		}
+		strides[i] = plane->stride;
+		offsets[i] = plane->offset;
+		modifiers[i] = buffer->modifier;
 	}
 
 	struct drm_buffer *drm_buffer = calloc(1, sizeof(*drm_buffer));
@@ -196,13 +206,10 @@ drm_import_base_buffer(struct drm *drm, struct base_buffer *buffer)
 
 	*drm_buffer = (struct drm_buffer) {
 		.destroy = drm_buffer_destroy,
-		.drm = drm,
+		.drm_fd = drm->fd,
 	};
-	uint32_t handles[4] = { handle };
-	uint32_t strides[4] = { buffer->stride };
-	uint32_t offsets[4] = { 0 };
-	uint64_t modifiers[4] = { buffer->modifier };
-	if (drmModeAddFB2WithModifiers(drm->fd, buffer->width, buffer->height, buffer->fourcc,
+	/* Cover the whole allocation so the framebuffer survives re-use for a smaller size */
+	if (drmModeAddFB2WithModifiers(drm->fd, buffer->alloc_width, buffer->alloc_height, buffer->fourcc,
 		handles, strides, offsets, modifiers, &drm_buffer->fb_id, 0))
 	{
 		perror("importing base buffer into drm failed");
@@ -221,6 +228,45 @@ cb_base_buffer_destroy(struct base_buffer *buffer, void *key, void *value)
 	drm_buffer->destroy(drm_buffer);
 }
 
+/* The framebuffer is created once per buffer and kept as attachment */
+static struct drm_buffer *
+drm_get_buffer(struct drm *drm, struct base_buffer *buffer)
+{
+	struct drm_buffer *drm_buffer = buffer->impl->get_attachment(buffer, drm);
+	if (!drm_buffer) {
+		drm_buffer = drm_import_base_buffer(drm, buffer);
+		if (!drm_buffer) {
+			return NULL;
+		}
+		buffer->impl->set_attachment(buffer, drm, drm_buffer, cb_base_buffer_destroy);
+	}
+	return drm_buffer;
+}
+
+static bool
+drm_prepare_buffer(struct drm *drm, struct base_buffer *buffer)
+{
+	return drm_get_buffer(drm, buffer);
+}
+
+static void
+replace_buffer(struct base_buffer **slot, struct base_buffer *buffer)
+{
+	if (*slot) {
+		(*slot)->impl->unlock(*slot);
+	}
+	*slot = buffer;
+}
+
+/* Locks the buffer as it is on screen now, releases everything it replaced */
+static void
+output_buffer_displayed(struct drm_output *output, struct base_buffer *buffer)
+{
+	buffer->impl->lock(buffer);
+	replace_buffer(&output->pending_buffer, NULL);
+	replace_buffer(&output->current_buffer, buffer);
+}
+
 static bool
 drm_output_set_mode(struct drm_output *output, struct drm_output_mode *mode, struct base_buffer *buffer)
 {
@@ -233,13 +279,9 @@ drm_output_set_mode(struct drm_output *output, struct drm_output_mode *mode, str
 		return false;
 	}
 
-	struct drm_buffer *drm_buffer = buffer->get_attachment(buffer, output->drm);
+	struct drm_buffer *drm_buffer = drm_get_buffer(output->drm, buffer);
 	if (!drm_buffer) {
-		drm_buffer = drm_import_base_buffer(output->drm, buffer);
-		if (!drm_buffer) {
-			return false;
-		}
-		buffer->set_attachment(buffer, output->drm, drm_buffer, cb_base_buffer_destroy);
+		return false;
 	}
 
 	drmModeAtomicReq *req = drmModeAtomicAlloc();
@@ -283,6 +325,10 @@ drm_output_set_mode(struct drm_output *output, struct drm_output_mode *mode, str
 		perror("drmModeAtomicCommit");
 		goto out;
 	}
+	output->src_width = buffer->width;
+	output->src_height = buffer->height;
+	/* Without NONBLOCK the modeset is done once the commit returns */
+	output_buffer_displayed(output, buffer);
 	ret = true;
 out:
 	drmModeAtomicFree(req);
@@ -293,12 +339,19 @@ out:
 }
 
 static bool
-_do_commit(struct drm_output *output, uint32_t fb_id, bool block)
+_do_commit(struct drm_output *output, uint32_t fb_id, uint32_t width, uint32_t height, bool block)
 {
 	drmModeAtomicReq *req = drmModeAtomicAlloc();
 	assert(req);
 	drmModeAtomicAddProperty(req, output->plane_id, output->props.plane.fb, fb_id);
 
+	/* Re-used buffers may be larger than their content, crop to it */
+	const bool src_changed = width != output->src_width || height != output->src_height;
+	if (src_changed) {
+		drmModeAtomicAddProperty(req, output->plane_id, output->props.plane.src_w, (uint64_t)width << 16);
+		drmModeAtomicAddProperty(req, output->plane_id, output->props.plane.src_h, (uint64_t)height << 16);
+	}
+
 	bool ret = false;
 	uint32_t flags = 0;
 	if (!block) {
@@ -309,6 +362,8 @@ _do_commit(struct drm_output *output, uint32_t fb_id, bool block)
 		perror("drmModeAtomicCommit");
 		goto out;
 	}
+	output->src_width = width;
+	output->src_height = height;
 	ret = true;
 out:
 	drmModeAtomicFree(req);
@@ -318,28 +373,34 @@ out:
 static bool
 drm_output_set_buffer(struct drm_output *output, struct base_buffer *buffer, bool block)
 {
-	struct drm_buffer *drm_buffer = buffer->get_attachment(buffer, output->drm);
+	struct drm_buffer *drm_buffer = drm_get_buffer(output->drm, buffer);
 	if (!drm_buffer) {
-		drm_buffer = drm_import_base_buffer(output->drm, buffer);
-		if (!drm_buffer) {
-			return false;
-		}
-		buffer->set_attachment(buffer, output->drm, drm_buffer, cb_base_buffer_destroy);
+		return false;
 	}
 
 	if (block) {
-		return _do_commit(output, drm_buffer->fb_id, block);
+		if (!_do_commit(output, drm_buffer->fb_id, buffer->width, buffer->height, block)) {
+			return false;
+		}
+		output_buffer_displayed(output, buffer);
+		return true;
 	}
 	assert(!output->requested_pageflip_fb_id);
 
 	// maybe try to commit with NONBLOCK first?
 	output->requested_pageflip_fb_id = drm_buffer->fb_id;
+	buffer->impl->lock(buffer);
+	replace_buffer(&output->queued_buffer, buffer);
 	return true;
 }
 
 static void
 drm_output_destroy(struct drm_output *output)
 {
+	replace_buffer(&output->queued_buffer, NULL);
+	replace_buffer(&output->pending_buffer, NULL);
+	replace_buffer(&output->current_buffer, NULL);
+
 	struct drm_output_mode *mode, *tmp;
 	wl_list_for_each_safe(mode, tmp, &output->modes, link) {
 		wl_list_remove(&mode->link);
@@ -439,6 +500,11 @@ page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned i
 {
 	struct drm_output *output = user_data;
 	assert(output);
+	/* The previous commit is on screen now */
+	if (output->pending_buffer) {
+		replace_buffer(&output->current_buffer, output->pending_buffer);
+		output->pending_buffer = NULL;
+	}
 	if (!output->requested_pageflip_fb_id) {
 		log("Connector %u: no frame scheduled", output->connector_id);
 		return;
@@ -450,11 +516,14 @@ page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned i
 	 * So we go with non-blocking and in case of using drm dumb buffers, use 3 per output
 	 */
 	static const bool block = false;
-	if (!_do_commit(output, output->requested_pageflip_fb_id, block)) {
+	struct base_buffer *buffer = output->queued_buffer;
+	if (!_do_commit(output, output->requested_pageflip_fb_id, buffer->width, buffer->height, block)) {
 		perror("commit failed");
 		return;
 	}
 	output->requested_pageflip_fb_id = 0;
+	output->pending_buffer = buffer;
+	output->queued_buffer = NULL;
 	if (output->on_frame_presented) {
 		output->on_frame_presented(output);
 	}
@@ -510,6 +579,7 @@ drm_create(int fd)
 	*drm = (struct drm) {
 		.fd = fd,
 		.read_events = drm_read_events,
+		.prepare_buffer = drm_prepare_buffer,
 		.destroy = drm_destroy,
 	};
 	wl_list_init(&drm->outputs);
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,6 +9,7 @@
 #include "log.h"
 
 #include "cursor-shape-v1.xml.h"
+#include "viewporter.xml.h"
 #include "wlr-layer-shell-unstable-v1.xml.h"
 #include "xdg-decoration-unstable-v1.xml.h"
 #include "xdg-shell.xml.h"
@@ -78,6 +80,11 @@ handle_registry_global(void *data, struct wl_registry *wl_registry,
 		client->state.cursor_shape_manager = wl_registry_bind(
 			wl_registry, global, &wp_cursor_shape_manager_v1_interface, version);
 	}
+
+	if (!client->state.viewporter && !strcmp(interface, wp_viewporter_interface.name)) {
+		client->state.viewporter = wl_registry_bind(
+			wl_registry, global, &wp_viewporter_interface, 1);
+	}
 }
 
 static void
@@ -111,22 +118,52 @@ client_connect(struct client *client)
 	CLIENT_CALLBACK(client, initial_sync);
 }
 
+static bool
+client_dispatch(struct client *client)
+{
+	struct wl_display *display = client->state.wl_display;
+	while (wl_display_prepare_read(display) != 0) {
+		if (wl_display_dispatch_pending(display) < 0) {
+			return false;
+		}
+	}
+	if (wl_display_flush(display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display);
+		return false;
+	}
+
+	/* Wake up in time to expire idle pool buffers, poll() ignores the fd of -1 */
+	struct base_memory_pressure *pressure = client->memory_pressure;
+	struct pollfd fds[2] = {
+		{ .fd = wl_display_get_fd(display), .events = POLLIN },
+		{ .fd = pressure ? pressure->fd : -1, .events = POLLPRI },
+	};
+	int ret = poll(fds, 2, base_buffer_pools_expire());
+	if (ret > 0 && fds[1].revents) {
+		const int state = pressure->dispatch(pressure, fds[1].revents);
+		if (state > 0) {
+			base_buffer_pools_trim();
+		} else if (state < 0) {
+			pressure->destroy(pressure);
+			client->memory_pressure = NULL;
+		}
+	}
+	if (ret <= 0 || !fds[0].revents) {
+		wl_display_cancel_read(display);
+		return ret >= 0 || errno == EINTR;
+	}
+	if (wl_display_read_events(display) < 0) {
+		return false;
+	}
+	return wl_display_dispatch_pending(display) >= 0;
+}
+
 static void
 client_loop(struct client *client)
 {
 	while (!client->should_terminate) {
 		errno = 0;
-		while (wl_display_dispatch(client->state.wl_display)) {
-			/* This space deliberately left blank */
-			if (client->should_terminate) {
-				break;
-			}
-		}
-		if (client->should_terminate) {
-			break;
-		} else if (errno == EAGAIN) {
-			//log("EAGAIN");
-		} else if (errno) {
+		if (!client_dispatch(client) && !client->should_terminate) {
 			perror("something wrong with the loop");
 			break;
 		}
@@ -144,11 +181,19 @@ client_terminate(struct client *client)
 	assert(!client->should_terminate);
 
 	/* FIXME: clean up remaining managers */
+	if (client->buffer_manager) {
+		client->buffer_manager->destroy(client->buffer_manager);
+		client->buffer_manager = NULL;
+	}
 
 	if (client->state.wl_compositor) {
 		wl_compositor_destroy(client->state.wl_compositor);
 		client->state.wl_compositor = NULL;
 	}
+	if (client->state.viewporter) {
+		wp_viewporter_destroy(client->state.viewporter);
+		client->state.viewporter = NULL;
+	}
 	if (client->state.wl_shm) {
 		wl_shm_destroy(client->state.wl_shm);
 		client->state.wl_shm = NULL;
@@ -167,6 +212,9 @@ static void
 client_destroy(struct client *client)
 {
 	CLIENT_CALLBACK(client, destroy);
+	if (client->memory_pressure) {
+		client->memory_pressure->destroy(client->memory_pressure);
+	}
 	wl_array_release(&client->callbacks);
 	free(client);
 }
@@ -184,6 +232,7 @@ client_create(void)
 		.destroy = client_destroy,
 		.shm_pool = shm_allocator_create(),
 		.drm_fd = -1,
+		.memory_pressure = base_memory_pressure_create(),
 	};
 	wl_array_init(&client->callbacks);
 	return client;
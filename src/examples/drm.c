@@ -5,20 +5,26 @@
 
 #include "buffer.h"
 #include "drm.h"
+#include "fourcc.h"
 #include "log.h"
 #include "render.h"
+#include "swapchain.h"
 
 #define BUFFERS 3
+#define LINE_WIDTH 10
+/* Horizontal period of raw_render_checkerboard() */
+#define CHECKERBOARD_PERIOD 64
 
 struct fancy_output {
 	struct drm_output *output;
-	struct base_buffer *buffers[BUFFERS];
-	uint32_t render_buffer;
+	struct base_swapchain *swapchain;
 	/* FPS counter */
 	uint32_t fps_start;
 	uint32_t frames;
 	/* Animation */
 	uint32_t center_x;
+	/* Position of the line in the previous frame, -1 if there is none */
+	int32_t last_x;
 };
 
 static uint32_t
@@ -42,39 +48,141 @@ dump_fps(struct fancy_output *fancy, uint32_t now, uint32_t delta)
 }
 
 static bool
-show_frame(struct fancy_output *output)
+show_frame(struct fancy_output *output, struct base_buffer *buffer, const struct base_rect *damage)
 {
-	struct base_buffer *buffer = output->buffers[output->render_buffer];
-
-	if (!output->output->set_buffer(output->output, buffer, /*block*/false)) {
+	bool ret = output->output->set_buffer(output->output, buffer, /*block*/false);
+	if (!ret) {
 		log("output commit failed");
-		return false;
 	}
-	return true;
+	output->swapchain->present(output->swapchain, buffer, damage);
+	return ret;
+}
+
+static struct base_rect
+line_rect(uint32_t line_x, uint32_t width, uint32_t height)
+{
+	const int32_t start = line_x > LINE_WIDTH / 2 ? line_x - LINE_WIDTH / 2 : 0;
+	const int32_t end = line_x + LINE_WIDTH / 2 < width ? line_x + LINE_WIDTH / 2 : width;
+	return (struct base_rect) { start, 0, end - start, height };
 }
 
 static void
-render_frame(struct fancy_output *output) {
-	struct base_buffer *buffer = output->buffers[output->render_buffer];
+render_frame(struct fancy_output *output, struct base_buffer *buffer, struct base_rect *damage) {
+	/* Only the previous and the new position of the line change */
+	*damage = line_rect(output->center_x, buffer->width, buffer->height);
+	if (output->last_x >= 0) {
+		const struct base_rect last = line_rect(output->last_x, buffer->width, buffer->height);
+		base_rect_union(damage, &last);
+	}
+
+	/* Plus whatever the buffer missed since it was on screen the last time */
+	struct base_rect repaint;
+	output->swapchain->get_damage(output->swapchain, buffer, &repaint);
+	base_rect_union(&repaint, damage);
+	const uint32_t repaint_x = repaint.x & ~(CHECKERBOARD_PERIOD - 1);
+	const uint32_t repaint_width = repaint.x + repaint.width - repaint_x;
 
 	//raw_render_gradient(dumb_buffer->pixels, buffer->width, buffer->height, buffer->stride, 0x80u);
 	//raw_render_solid(dumb_buffer->pixels, buffer->width, buffer->height, buffer->stride, 0xff0000ffu);
-	void *pixels = buffer->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
-	raw_render_checkerboard(pixels, buffer->width, buffer->height, buffer->stride);
+	void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	raw_render_checkerboard((uint8_t *)pixels + repaint_x * fourcc_get_bytes_per_pixel(buffer->fourcc), repaint_width,
+		buffer->height, buffer->stride);
 	raw_render_y_line(pixels, buffer->width, buffer->height,
-			buffer->stride, output->center_x, 10, 0x00ff0000u);
-	buffer->get_pixels_end(buffer, pixels);
+			buffer->stride, output->center_x, LINE_WIDTH, 0x00ff0000u);
+	buffer->impl->get_pixels_end(buffer, pixels);
+	output->last_x = output->center_x;
 	output->center_x = (output->center_x + 5) % buffer->width;
 }
 
+static void
+prepare_buffer(struct base_buffer *buffer, void *data)
+{
+	struct drm *drm = data;
+	drm->prepare_buffer(drm, buffer);
+}
+
+static struct drm_output_mode *
+get_preferred_mode(struct drm_output *output)
+{
+	struct drm_output_mode *mode;
+	wl_list_for_each(mode, &output->modes, link) {
+		if (mode->preferred) {
+			return mode;
+		}
+	}
+	return NULL;
+}
+
+struct mode_size {
+	uint32_t width;
+	uint32_t height;
+	uint32_t outputs;
+};
+
+static int
+compare_mode_size(const void *a, const void *b)
+{
+	const struct mode_size *size_a = a, *size_b = b;
+	const uint64_t area_a = (uint64_t)size_a->width * size_a->height;
+	const uint64_t area_b = (uint64_t)size_b->width * size_b->height;
+	return area_a < area_b ? -1 : area_a > area_b;
+}
+
+/*
+ * Allocate, map and import the buffers of all outputs before the mode set.
+ * A reservation counts the idle buffers already in the pool, so outputs of
+ * the same mode size share one with their combined count. Smaller sizes go
+ * first, otherwise their reservation would crop the larger idle buffers.
+ */
+static void
+reserve_buffers(struct drm *drm, struct base_allocator *allocator)
+{
+	struct mode_size *sizes = calloc(wl_list_length(&drm->outputs), sizeof(*sizes));
+	uint32_t size_count = 0;
+	struct drm_output *output;
+	wl_list_for_each(output, &drm->outputs, link) {
+		const struct drm_output_mode *mode = get_preferred_mode(output);
+		if (!mode) {
+			continue;
+		}
+		uint32_t i = 0;
+		while (i < size_count && (sizes[i].width != mode->width || sizes[i].height != mode->height)) {
+			i++;
+		}
+		if (i == size_count) {
+			sizes[size_count++] = (struct mode_size) { mode->width, mode->height, 0 };
+		}
+		sizes[i].outputs++;
+	}
+	qsort(sizes, size_count, sizeof(*sizes), compare_mode_size);
+
+	for (uint32_t i = 0; i < size_count; i++) {
+		allocator->reserve(allocator, &(struct base_buffer_reservation) {
+			.count = BUFFERS * sizes[i].outputs,
+			.width = sizes[i].width,
+			.height = sizes[i].height,
+			.fourcc = DRM_FORMAT_XRGB8888,
+			.modifier = DRM_FORMAT_MOD_LINEAR,
+			.usage = BASE_BUFFER_USAGE_SCANOUT | BASE_BUFFER_USAGE_CPU_WRITE,
+			.prepare = prepare_buffer,
+			.data = drm,
+		});
+	}
+	free(sizes);
+}
+
 static void
 on_frame_presented(struct drm_output *output)
 {
 	struct fancy_output *fancy = output->data;
 	fancy->frames++;
-	fancy->render_buffer = (fancy->render_buffer + 1) % BUFFERS;
-	render_frame(fancy);
-	show_frame(fancy);
+	struct base_buffer *buffer = fancy->swapchain->acquire(fancy->swapchain);
+	if (!buffer) {
+		return;
+	}
+	struct base_rect damage;
+	render_frame(fancy, buffer, &damage);
+	show_frame(fancy, buffer, &damage);
 }
 
 
@@ -97,12 +205,23 @@ main(int argc, const char *argv[])
 
 	struct base_allocator *allocator = gbm_allocator_create(fd);
 	if (!allocator) {
-		log("Failed to create gbm allocator");
+		/* E.g. vkms or simpledrm */
+		log("Failed to create gbm allocator, falling back to dumb buffers");
+		allocator = drm_allocator_create(fd);
+	}
+	if (!allocator) {
+		log("Failed to create allocator");
 		drm->destroy(drm);
 		return 2;
 	}
 
 	struct fancy_output *outputs = calloc(wl_list_length(&drm->outputs), sizeof(*outputs));
+	/* Keep the reserved buffers of all outputs until their swapchains pick them up */
+	allocator->set_policy(allocator, &(struct base_buffer_pool_policy) {
+		.max_idle = BUFFERS * wl_list_length(&drm->outputs),
+		.max_slack_percent = BASE_BUFFER_POOL_DEFAULT_MAX_SLACK_PERCENT,
+	});
+	reserve_buffers(drm, allocator);
 	uint32_t now = get_time_msec();
 
 	/* Setup */
@@ -120,23 +239,24 @@ main(int argc, const char *argv[])
 
 				fancy->output = output;
 				fancy->fps_start = now;
-				fancy->render_buffer = 0;
 				fancy->center_x = mode->width / 2;
-				for (int b = 0; b < BUFFERS; b++) {
-					/* FIXME: needs a output->formats lookup */
-					fancy->buffers[b] = allocator->create_buffer(
-						allocator, mode->width, mode->height,
-						DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR
-					);
-					fancy->buffers[b]->lock(fancy->buffers[b]);
-				}
-				render_frame(fancy);
-				output->set_mode(output, mode, fancy->buffers[0]);
-
-				fancy->render_buffer = 1 % BUFFERS;
+				fancy->last_x = -1;
+				/* FIXME: needs a output->formats lookup */
+				fancy->swapchain = base_swapchain_create(allocator, BUFFERS,
+					mode->width, mode->height,
+					DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR,
+					BASE_BUFFER_USAGE_SCANOUT | BASE_BUFFER_USAGE_CPU_WRITE
+				);
+				struct base_rect damage;
+				struct base_buffer *buffer = fancy->swapchain->acquire(fancy->swapchain);
+				render_frame(fancy, buffer, &damage);
+				output->set_mode(output, mode, buffer);
+				fancy->swapchain->present(fancy->swapchain, buffer, &damage);
+
 				fancy->center_x = mode->width / 2 - 50;
-				render_frame(fancy);
-				show_frame(fancy);
+				buffer = fancy->swapchain->acquire(fancy->swapchain);
+				render_frame(fancy, buffer, &damage);
+				show_frame(fancy, buffer, &damage);
 				output->mode = mode;
 				break;
 			}
@@ -160,6 +280,8 @@ main(int argc, const char *argv[])
 			}
 
 		}
+		/* Page flips wake us up often enough to not need the returned timeout */
+		base_buffer_pools_expire();
 		if (!drm->read_events(drm, /*block*/true)) {
 			log("Failed to wait for drm page flip");
 			break;
@@ -177,16 +299,22 @@ main(int argc, const char *argv[])
 			dump_fps(fancy, now, delta);
 		}
 
-		for (int b = 0; b < BUFFERS; b++) {
-			struct base_buffer *buffer = fancy->buffers[b];
-			if (buffer) {
-				buffer->unlock(buffer);
-			}
+		if (fancy->swapchain->starved_count) {
+			log("Connector %u: swapchain starved %u times", fancy->output->connector_id,
+				fancy->swapchain->starved_count);
 		}
+		fancy->swapchain->destroy(fancy->swapchain);
 	}
-	allocator->destroy(allocator);
-
 	free(outputs);
+
+	struct base_allocator_stats stats;
+	base_allocator_get_stats(allocator, &stats);
+	log("Allocator: %lu buffers allocated, %lu exact and %lu close pool hits, %lu evictions, %lu maps",
+		stats.total.misses, stats.total.exact_hits, stats.total.close_hits,
+		stats.total.evictions, stats.total.maps);
+
+	/* Outputs keep the buffers on screen locked until they are destroyed */
 	drm->destroy(drm);
+	allocator->destroy(allocator);
 	return 0;
 }
@@ -7,23 +7,66 @@
 #include "buffer.h"
 #include "drm.h"
 #include "drm_lease.h"
+#include "fourcc.h"
 #include "log.h"
 #include "render.h"
+#include "swapchain.h"
 
 #define BUFFER_COUNT 2
+#define LINE_WIDTH 10
+/* Horizontal period of raw_render_checkerboard() */
+#define CHECKERBOARD_PERIOD 64
 
 struct fancy_output {
 	struct drm_output *output;
-	struct base_buffer *buffers[BUFFER_COUNT];
-	uint8_t render_buffer;
+	struct base_swapchain *swapchain;
 	/* Animation stuff */
 	uint32_t center_x;
 	uint32_t center_y;
+	/* Position of the line in the previous frame, -1 if there is none */
+	int32_t last_x;
 	/* FPS counter */
 	time_t start;
 	uint64_t frames;
 };
 
+static struct base_rect
+line_rect(uint32_t line_x, uint32_t width, uint32_t height)
+{
+	const int32_t start = line_x > LINE_WIDTH / 2 ? line_x - LINE_WIDTH / 2 : 0;
+	const int32_t end = line_x + LINE_WIDTH / 2 < width ? line_x + LINE_WIDTH / 2 : width;
+	return (struct base_rect) { start, 0, end - start, height };
+}
+
+static void
+render_frame(struct fancy_output *fancy, struct base_buffer *buffer, uint32_t color, struct base_rect *damage)
+{
+	/* Only the previous and the new position of the line change */
+	*damage = line_rect(fancy->center_x, buffer->width, buffer->height);
+	if (fancy->last_x >= 0) {
+		const struct base_rect last = line_rect(fancy->last_x, buffer->width, buffer->height);
+		base_rect_union(damage, &last);
+	}
+
+	/* Plus whatever the buffer missed since it was on screen the last time */
+	struct base_rect repaint;
+	fancy->swapchain->get_damage(fancy->swapchain, buffer, &repaint);
+	base_rect_union(&repaint, damage);
+	const uint32_t repaint_x = repaint.x & ~(CHECKERBOARD_PERIOD - 1);
+	const uint32_t repaint_width = repaint.x + repaint.width - repaint_x;
+
+	void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	raw_render_checkerboard((uint8_t *)pixels + repaint_x * fourcc_get_bytes_per_pixel(buffer->fourcc),
+		repaint_width, buffer->height, buffer->stride);
+	//raw_render_gradient(pixels, buffer->width,
+	//	buffer->height, buffer->stride, now & 0xff);
+	raw_render_y_line(pixels, buffer->width, buffer->height,
+		buffer->stride, fancy->center_x, LINE_WIDTH, color);
+	buffer->impl->get_pixels_end(buffer, pixels);
+	fancy->last_x = fancy->center_x;
+	fancy->center_x = (fancy->center_x + 5) % buffer->width;
+}
+
 static void
 hello_kms(int drm_fd)
 {
@@ -38,7 +81,7 @@ hello_kms(int drm_fd)
 		return;
 	}
 
-	struct fancy_output fancy = {0};
+	struct fancy_output fancy = { .last_x = -1 };
 
 	struct base_allocator *alloc = gbm_allocator_create(drm_fd);
 
@@ -51,15 +94,14 @@ hello_kms(int drm_fd)
 				uint32_t format = DRM_FORMAT_XRGB8888;
 
 				fancy.output = output;
-				fancy.render_buffer = 1;
-				for (int i = 0; i < BUFFER_COUNT; i++) {
-					fancy.buffers[i] = alloc->create_buffer(alloc,
-						mode->width, mode->height,
-						format, DRM_FORMAT_MOD_LINEAR
-					);
-					fancy.buffers[i]->lock(fancy.buffers[i]);
-				}
-				output->set_mode(output, mode, fancy.buffers[0]);
+				fancy.swapchain = base_swapchain_create(alloc, BUFFER_COUNT,
+					mode->width, mode->height,
+					format, DRM_FORMAT_MOD_LINEAR,
+					BASE_BUFFER_USAGE_SCANOUT | BASE_BUFFER_USAGE_CPU_WRITE
+				);
+				struct base_buffer *buffer = fancy.swapchain->acquire(fancy.swapchain);
+				output->set_mode(output, mode, buffer);
+				fancy.swapchain->present(fancy.swapchain, buffer, NULL);
 				log("Using %ux%u@%u", mode->width, mode->height, mode->refresh);
 				break;
 			}
@@ -82,20 +124,15 @@ hello_kms(int drm_fd)
 			fancy.start = start;
 		}
 
-		struct base_buffer *buffer = fancy.buffers[fancy.render_buffer];
-		void *pixels = buffer->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
-
-		raw_render_checkerboard(pixels, buffer->width,
-			buffer->height, buffer->stride);
-		//raw_render_gradient(pixels, buffer->width,
-		//	buffer->height, buffer->stride, now & 0xff);
-		raw_render_y_line(pixels, buffer->width, buffer->height,
-			buffer->stride, fancy.center_x, 10, now & 0xffffffffu);
-		buffer->get_pixels_end(buffer, pixels);
-		fancy.center_x = (fancy.center_x + 5) % buffer->width;
+		struct base_buffer *buffer = fancy.swapchain->acquire(fancy.swapchain);
+		if (!buffer) {
+			break;
+		}
+		struct base_rect damage;
+		render_frame(&fancy, buffer, now & 0xffffffffu, &damage);
 
 		fancy.output->set_buffer(output, buffer, /*block*/true);
-		fancy.render_buffer = (fancy.render_buffer + 1) % BUFFER_COUNT;
+		fancy.swapchain->present(fancy.swapchain, buffer, &damage);
 
 		fancy.frames++;
 		now = time(NULL);
@@ -106,15 +143,11 @@ hello_kms(int drm_fd)
 		}
 	}
 
-	for (int i = 0; i < BUFFER_COUNT; i++) {
-		struct base_buffer *buffer = fancy.buffers[i];
-		if (buffer) {
-			buffer->unlock(buffer);
-		}
-	}
+	fancy.swapchain->destroy(fancy.swapchain);
+	/* Outputs keep the buffers on screen locked until they are destroyed */
+	drm->destroy(drm);
 	alloc->destroy(alloc);
 	log("Done");
-	drm->destroy(drm);
 }
 
 static void
@@ -9,7 +9,8 @@ render_frame(struct layershell *layer, uint32_t color)
 	struct base_allocator *pool = layer->surface->client->shm_pool;
 	struct base_buffer *buffer = pool->create_buffer(pool,
 		layer->current.width, layer->current.height,
-		DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR
+		DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR,
+		BASE_BUFFER_USAGE_CPU_WRITE
 	);
 	render_solid(buffer, color);
 	layer->surface->set_buffer(layer->surface, buffer);
@@ -45,17 +45,18 @@ shm_allocator(struct ext_capture_session *session)
 	uint32_t *shm_format = session->shm.formats.data;
 	return allocator->create_buffer(allocator,
 		session->width, session->height,
-		fourcc_from_shm_format(*shm_format), DRM_FORMAT_MOD_LINEAR
+		fourcc_from_shm_format(*shm_format), DRM_FORMAT_MOD_LINEAR,
+		BASE_BUFFER_USAGE_CPU_READ
 	);
 }
 
 static struct base_buffer *
 dmabuf_allocator(struct ext_capture_session *session)
 {
-	struct ext_capture_dmabuf_format *drm_fmt = session->drm.formats.data;
-	return allocator->create_buffer(allocator,
-		session->width, session->height,
-		drm_fmt->fourcc, drm_fmt->modifier
+	return allocator->create_buffer_from_list(allocator,
+		session->width, session->height, session->drm.formats.data,
+		session->drm.formats.size / sizeof(struct base_format),
+		BASE_BUFFER_USAGE_CPU_READ
 	);
 }
 
@@ -92,6 +93,12 @@ handle_toplevels_sync(struct toplevel_handle_manager *toplevels, void *data)
 	if (!allocator) {
 		allocator = gbm_allocator_create(client->drm_fd);
 		if (allocator) {
+			/* Capture buffers have to match the session size */
+			allocator->set_policy(allocator, &(struct base_buffer_pool_policy) {
+				.max_idle = BASE_BUFFER_POOL_DEFAULT_MAX_IDLE,
+				.max_slack_percent = BASE_BUFFER_POOL_DEFAULT_MAX_SLACK_PERCENT,
+				.exact_size = true,
+			});
 			alloc_func = dmabuf_allocator;
 			log("Using gbm allocator");
 		} else {
@@ -9,7 +9,8 @@ render_frame(struct toplevel *toplevel, uint32_t color)
 	struct base_allocator *pool = toplevel->surface->client->shm_pool;
 	struct base_buffer *buffer = pool->create_buffer(pool,
 		toplevel->pending.width, toplevel->pending.height,
-		DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR
+		DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR,
+		BASE_BUFFER_USAGE_CPU_WRITE
 	);
 	render_solid(buffer, color);
 	toplevel->surface->set_buffer(toplevel->surface, buffer);
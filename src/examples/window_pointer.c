@@ -1,13 +1,104 @@
 #include "base.h"
 #include <stdio.h>
 
+#include "buffer.h"
+#include "fourcc.h"
+#include "render.h"
+
 #include "cursor-shape-v1.xml.h"
 
+#define LINE_WIDTH 4
+/* Horizontal period of raw_render_checkerboard() */
+#define CHECKERBOARD_PERIOD 64
+
+/* A vertical line follows the pointer, only the columns it left and entered are repainted */
+static struct {
+	uint32_t width;
+	uint32_t height;
+	/* -1 while the pointer is outside */
+	int32_t x;
+	/* Position of the line in the previous frame, -1 if there is none */
+	int32_t last_x;
+	bool frame_pending;
+} line = { .x = -1, .last_x = -1 };
+
+static struct base_rect
+line_rect(uint32_t line_x, uint32_t width, uint32_t height)
+{
+	const int32_t start = line_x > LINE_WIDTH / 2 ? line_x - LINE_WIDTH / 2 : 0;
+	const int32_t end = line_x + LINE_WIDTH / 2 < width ? line_x + LINE_WIDTH / 2 : width;
+	return (struct base_rect) { start, 0, end - start, height };
+}
+
+static void
+handle_surface_render(struct base_buffer *buffer, const struct base_rect *buffer_damage, struct base_rect *damage)
+{
+	/* Only the previous and the new position of the line change */
+	*damage = (struct base_rect) { 0 };
+	if (line.last_x >= 0) {
+		*damage = line_rect(line.last_x, buffer->width, buffer->height);
+	}
+	if (line.x >= 0) {
+		const struct base_rect current = line_rect(line.x, buffer->width, buffer->height);
+		base_rect_union(damage, &current);
+	}
+
+	/* Plus whatever the buffer missed since it was on screen the last time */
+	struct base_rect repaint = *buffer_damage;
+	base_rect_union(&repaint, damage);
+	const uint32_t repaint_x = repaint.x & ~(CHECKERBOARD_PERIOD - 1);
+	const uint32_t repaint_width = repaint.x + repaint.width - repaint_x;
+
+	uint8_t *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	if (!pixels) {
+		return;
+	}
+	if (repaint.width > 0) {
+		raw_render_checkerboard(pixels + repaint_x * fourcc_get_bytes_per_pixel(buffer->fourcc),
+			repaint_width, buffer->height, buffer->stride);
+	}
+	if (line.x >= 0) {
+		raw_render_y_line(pixels, buffer->width, buffer->height,
+			buffer->stride, line.x, LINE_WIDTH, 0xffff0000u);
+	}
+	buffer->impl->get_pixels_end(buffer, pixels);
+	line.last_x = line.x;
+}
+
+static void render_line_frame(struct surface *surface);
+
+static void
+handle_frame_callback(struct surface *surface, uint32_t time_msec, void *data)
+{
+	line.frame_pending = false;
+	render_line_frame(surface);
+}
+
+/* At most one frame per frame callback, pointer motion may arrive much faster */
+static void
+render_line_frame(struct surface *surface)
+{
+	if (line.frame_pending || line.x == line.last_x) {
+		return;
+	}
+	line.frame_pending = true;
+	surface->request_frame(surface, handle_frame_callback, NULL);
+	surface->render_frame(surface, line.width, line.height);
+}
+
+static void
+move_line(struct surface *surface, int32_t x)
+{
+	line.x = x >= 0 && x < (int32_t)line.width ? x : -1;
+	render_line_frame(surface);
+}
+
 static void
 handle_toplevel_reconfigure(struct toplevel *toplevel, void *data, int width, int height)
 {
-	toplevel->surface->render_frame(toplevel->surface,
-		width > 0 ? width : 800, height > 0 ? height: 600);
+	line.width = width > 0 ? width : 800;
+	line.height = height > 0 ? height: 600;
+	toplevel->surface->render_frame(toplevel->surface, line.width, line.height);
 }
 
 static void
@@ -22,6 +113,7 @@ static void
 handle_pointer_enter(struct surface *surface, void *data, wl_fixed_t sx, wl_fixed_t sy)
 {
 	fprintf(stderr, "pointer enter at %d,%d\n", wl_fixed_to_int(sx), wl_fixed_to_int(sy));
+	move_line(surface, wl_fixed_to_int(sx));
 	struct toplevel *toplevel = data;
 	struct seat *seat = toplevel->surface->client->seat;
 	if (seat) {
@@ -33,6 +125,7 @@ static void
 handle_pointer_motion(struct surface *surface, void *data, wl_fixed_t sx, wl_fixed_t sy)
 {
 	fprintf(stderr, "pointer motion at %d,%d\n", wl_fixed_to_int(sx), wl_fixed_to_int(sy));
+	move_line(surface, wl_fixed_to_int(sx));
 }
 
 static void
@@ -58,6 +151,7 @@ static void
 handle_pointer_leave(struct surface *surface, void *data)
 {
 	fprintf(stderr, "pointer leave\n");
+	move_line(surface, -1);
 }
 
 static void
@@ -79,7 +173,7 @@ handle_initial_sync(struct client *client, void *data)
 		.pointer_leave = handle_pointer_leave,
 		.data = toplevel,
 	});
-	toplevel->surface->set_render_func(toplevel->surface, render_solid_black);
+	toplevel->surface->set_damage_render_func(toplevel->surface, handle_surface_render);
 }
 
 int
@@ -57,7 +57,7 @@ frame_handle_ready(void *data, struct ext_image_copy_capture_frame_v1 *frame)
 	struct ext_capture_session *session = capture_data->session;
 	ext_image_copy_capture_frame_v1_destroy(frame);
 
-	capture_data->buffer->mark_dirty(capture_data->buffer);
+	capture_data->buffer->impl->mark_dirty(capture_data->buffer);
 	SESSION_CALLBACK(session, buffer_ready, capture_data->buffer);
 	free(capture_data);
 	_capture(session);
@@ -89,7 +89,7 @@ _capture(struct ext_capture_session *session) {
 		return;
 	}
 	struct client *client = session->manager->client;
-	struct wl_buffer *wl_buffer = buffer->get_wl_buffer(buffer, client);
+	struct wl_buffer *wl_buffer = buffer->impl->get_wl_buffer(buffer, client);
 	if (!wl_buffer) {
 		log("failed to get wl_buffer from base_buffer");
 		return;
@@ -139,9 +139,9 @@ session_handle_dmabuf_format(void *data, struct ext_image_copy_capture_session_v
 	struct ext_capture_session *session = data;
 	uint64_t *modifier;
 	wl_array_for_each(modifier, modifiers) {
-		struct ext_capture_dmabuf_format *entry = wl_array_add(&session->drm_formats_tmp, sizeof(*entry));
+		struct base_format *entry = wl_array_add(&session->drm_formats_tmp, sizeof(*entry));
 		assert(entry);
-		*entry = (struct ext_capture_dmabuf_format){ format, *modifier };
+		*entry = (struct base_format){ format, *modifier };
 	}
 }
 
@@ -171,7 +171,7 @@ session_handle_done(void *data, struct ext_image_copy_capture_session_v1 *sessio
 	wl_array_init(&session->drm_formats_tmp);
 
 	log("Supported DRM formats:");
-	struct ext_capture_dmabuf_format *drm_format;
+	struct base_format *drm_format;
 	wl_array_for_each(drm_format, &session->drm.formats) {
 		log(" - 0x%08x (modifier 0x%016lx)", drm_format->fourcc, drm_format->modifier);
 	}
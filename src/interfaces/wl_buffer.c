@@ -30,6 +30,10 @@ struct wl_buffer_manager {
 	struct {
 		struct wl_shm *global;
 	} shm;
+	/* Created on demand for buffers which can't be exported directly */
+	struct base_allocator *staging_allocator;
+	/* struct staging of all source buffers */
+	struct wl_list stagings;
 };
 
 static void
@@ -203,6 +207,37 @@ handle_global(struct client *client, void *data, struct wl_registry *registry,
 	}
 }
 
+struct slab_pool {
+	struct wl_shm_pool *wl_shm_pool;
+	uint32_t size;
+};
+
+static void
+cb_slab_attachment_destroy(struct base_shm_slab *slab, void *key, void *value)
+{
+	struct slab_pool *slab_pool = value;
+	wl_shm_pool_destroy(slab_pool->wl_shm_pool);
+	free(slab_pool);
+}
+
+static struct wl_shm_pool *
+shm_get_slab_pool(struct wl_buffer_manager *manager, struct base_shm_slab *slab)
+{
+	/* One wl_shm_pool per slab, kept alive and resized as the slab grows */
+	struct slab_pool *slab_pool = base_shm_slab_get_attachment(slab, manager);
+	if (!slab_pool) {
+		slab_pool = calloc(1, sizeof(*slab_pool));
+		assert(slab_pool);
+		slab_pool->wl_shm_pool = wl_shm_create_pool(manager->shm.global, slab->fd, slab->size);
+		slab_pool->size = slab->size;
+		base_shm_slab_set_attachment(slab, manager, slab_pool, cb_slab_attachment_destroy);
+	} else if (slab_pool->size < slab->size) {
+		wl_shm_pool_resize(slab_pool->wl_shm_pool, slab->size);
+		slab_pool->size = slab->size;
+	}
+	return slab_pool->wl_shm_pool;
+}
+
 static struct wl_buffer *
 shm_create_wl_buffer(struct wl_buffer_manager *manager, struct base_buffer *buffer)
 {
@@ -210,13 +245,24 @@ shm_create_wl_buffer(struct wl_buffer_manager *manager, struct base_buffer *buff
 		log("Compositor does not provide SHM support");
 		return NULL;
 	}
-	const int fd = buffer->get_fd(buffer);
-	const uint32_t byte_size  = buffer->get_byte_size(buffer);
+
+	uint32_t slab_offset = 0;
+	struct base_shm_slab *slab = buffer->impl->get_shm_slab
+		? buffer->impl->get_shm_slab(buffer, &slab_offset) : NULL;
+	if (slab) {
+		return wl_shm_pool_create_buffer(shm_get_slab_pool(manager, slab), slab_offset,
+			buffer->alloc_width, buffer->alloc_height, buffer->stride,
+			fourcc_to_shm_format(buffer->fourcc)
+		);
+	}
+
+	const int fd = buffer->impl->get_shm_fd ? buffer->impl->get_shm_fd(buffer) : buffer->impl->get_fd(buffer);
+	const uint32_t byte_size  = buffer->impl->get_byte_size(buffer);
 	const int offset = 0;
 
 	struct wl_shm_pool *shm_pool = wl_shm_create_pool(manager->shm.global, fd, byte_size);
 	struct wl_buffer * wl_buffer = wl_shm_pool_create_buffer(shm_pool, offset,
-		buffer->width, buffer->height, buffer->stride,
+		buffer->alloc_width, buffer->alloc_height, buffer->stride,
 		fourcc_to_shm_format(buffer->fourcc)
 	);
 	wl_shm_pool_destroy(shm_pool);
@@ -231,18 +277,19 @@ dmabuf_create_wl_buffer(struct wl_buffer_manager *manager, struct base_buffer *b
 		return NULL;
 	}
 
-	const int fd = buffer->get_fd(buffer);
-	const uint32_t plane_idx = 0; // TODO: maybe support multi-planar formats
-	const uint32_t offset = 0;
 	const uint32_t mod_hi = buffer->modifier >> 32;
 	const uint32_t mod_low = buffer->modifier & UINT32_MAX;
 	const uint32_t flags = 0;
 
 	struct zwp_linux_buffer_params_v1 *params =
 		zwp_linux_dmabuf_v1_create_params(manager->dmabuf.global);
-	zwp_linux_buffer_params_v1_add(params, fd, plane_idx, offset, buffer->stride, mod_hi, mod_low);
+	for (uint32_t plane_idx = 0; plane_idx < buffer->plane_count; plane_idx++) {
+		const struct base_buffer_plane *plane = &buffer->planes[plane_idx];
+		zwp_linux_buffer_params_v1_add(params, plane->fd, plane_idx,
+			plane->offset, plane->stride, mod_hi, mod_low);
+	}
 	struct wl_buffer *wl_buffer = zwp_linux_buffer_params_v1_create_immed(
-		params, buffer->width, buffer->height, buffer->fourcc, flags
+		params, buffer->alloc_width, buffer->alloc_height, buffer->fourcc, flags
 	);
 	zwp_linux_buffer_params_v1_destroy(params);
 	return wl_buffer;
@@ -260,20 +307,209 @@ static void
 handle_wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
 	struct base_buffer *buffer = data;
-	buffer->unlock(buffer);
+	buffer->impl->unlock(buffer);
 }
 
 static struct wl_buffer_listener wl_buffer_listener = {
 	.release = handle_wl_buffer_release,
 };
 
+/*
+ * Staging for buffers which only provide CPU access
+ *
+ * The contents are copied into exportable buffers of the same format, the
+ * source itself is never locked by the compositor. Each staging buffer
+ * remembers the source serial it was last updated to, so only the damage
+ * since then has to be copied (see buffer->impl->add_damage()).
+ */
+
+/* Copies per source buffer, so an upload doesn't have to wait for the compositor to release one */
+#define STAGING_DEPTH 2
+
+struct staging {
+	/* NULL once the manager is destroyed */
+	struct wl_buffer_manager *manager;
+	struct wl_list link;
+	struct staging_slot {
+		/* Locked for as long as it belongs to the source buffer */
+		struct base_buffer *buffer;
+		/* Source serial the contents correspond to */
+		uint32_t serial;
+		bool valid;
+	} slots[STAGING_DEPTH];
+};
+
+static void
+cb_staging_destroy(struct base_buffer *buffer, void *key, void *value)
+{
+	/* Staging buffers still held by the compositor return to the pool on release */
+	struct staging *staging = value;
+	for (uint32_t i = 0; i < STAGING_DEPTH; i++) {
+		if (staging->slots[i].buffer) {
+			staging->slots[i].buffer->impl->unlock(staging->slots[i].buffer);
+		}
+	}
+	if (staging->manager) {
+		wl_list_remove(&staging->link);
+	}
+	free(staging);
+}
+
+static struct base_allocator *
+staging_get_allocator(struct wl_buffer_manager *manager)
+{
+	if (manager->staging_allocator) {
+		return manager->staging_allocator;
+	}
+	struct client *client = manager->base.client;
+	struct base_allocator *allocator = NULL;
+	if (client->drm_fd >= 0) {
+		allocator = gbm_allocator_create(client->drm_fd);
+	}
+	if (!allocator) {
+		allocator = udmabuf_allocator_create();
+	}
+	if (!allocator) {
+		log("No dmabuf allocator available for staging, falling back to SHM");
+		allocator = shm_allocator_create();
+	}
+	if (!allocator) {
+		return NULL;
+	}
+	/* Staging buffers always match the full allocation of the source */
+	allocator->set_policy(allocator, &(struct base_buffer_pool_policy) {
+		.max_idle = STAGING_DEPTH,
+		.exact_size = true,
+	});
+	manager->staging_allocator = allocator;
+	return allocator;
+}
+
+static bool
+staging_copy(struct base_buffer *dst, struct base_buffer *src, const struct base_rect *damage)
+{
+	const struct fourcc_details *format = fourcc_get_details(src->fourcc);
+	assert(format);
+
+	uint8_t *src_pixels = src->impl->get_pixels(src, BASE_ALLOCATOR_REQ_READ);
+	if (!src_pixels) {
+		return false;
+	}
+	uint8_t *dst_pixels = dst->impl->get_pixels(dst, BASE_ALLOCATOR_REQ_WRITE);
+	if (!dst_pixels) {
+		src->impl->get_pixels_end(src, src_pixels);
+		return false;
+	}
+
+	/* get_pixels() maps the buffer starting with the first plane */
+	for (uint32_t i = 0; i < src->plane_count; i++) {
+		const uint32_t hsub = i ? format->hsub : 1;
+		const uint32_t vsub = i ? format->vsub : 1;
+		const uint32_t block_width = i ? 1 : format->block_width;
+		const uint32_t x = damage->x / hsub / block_width;
+		const uint32_t x_end = FOURCC_DIV_ROUND_UP(
+			FOURCC_DIV_ROUND_UP(damage->x + damage->width, hsub), block_width);
+		const uint32_t y_end = FOURCC_DIV_ROUND_UP(damage->y + damage->height, vsub);
+		const size_t len = (size_t)(x_end - x) * format->block_size[i];
+
+		const struct base_buffer_plane *src_plane = &src->planes[i];
+		const struct base_buffer_plane *dst_plane = &dst->planes[i];
+		const uint8_t *from = src_pixels + src_plane->offset - src->planes[0].offset
+			+ (size_t)x * format->block_size[i];
+		uint8_t *to = dst_pixels + dst_plane->offset - dst->planes[0].offset
+			+ (size_t)x * format->block_size[i];
+		for (uint32_t y = damage->y / vsub; y < y_end; y++) {
+			memcpy(to + (size_t)y * dst_plane->stride, from + (size_t)y * src_plane->stride, len);
+		}
+	}
+
+	dst->impl->get_pixels_end(dst, dst_pixels);
+	src->impl->get_pixels_end(src, src_pixels);
+	return true;
+}
+
 static struct wl_buffer *
-buffer_manager_create_wl_buffer(struct base_wl_buffer_manager *_manager, struct base_buffer *buffer)
+staging_create_wl_buffer(struct wl_buffer_manager *manager, struct base_buffer *buffer)
 {
-	struct wl_buffer_manager *manager = (void *)_manager;
-	struct wl_buffer *wl_buffer = buffer->get_attachment(buffer, manager);
+	struct staging *staging = buffer->impl->get_attachment(buffer, &manager->staging_allocator);
+	if (!staging) {
+		if (!fourcc_get_details(buffer->fourcc)) {
+			log("Can't stage buffer with unknown format 0x%08x", buffer->fourcc);
+			return NULL;
+		}
+		staging = calloc(1, sizeof(*staging));
+		assert(staging);
+		staging->manager = manager;
+		wl_list_insert(&manager->stagings, &staging->link);
+		buffer->impl->set_attachment(buffer, &manager->staging_allocator, staging, cb_staging_destroy);
+	}
+
+	/* Prefer the most recently updated copy the compositor is done with */
+	struct staging_slot *slot = NULL;
+	for (uint32_t i = 0; i < STAGING_DEPTH; i++) {
+		struct staging_slot *candidate = &staging->slots[i];
+		if (candidate->buffer && candidate->buffer->locks > 1) {
+			continue;
+		}
+		if (!slot || (candidate->valid && (!slot->valid
+				|| (int32_t)(candidate->serial - slot->serial) > 0))) {
+			slot = candidate;
+		}
+	}
+	if (!slot) {
+		log("Compositor still holds all %u staging buffers of buffer %p", STAGING_DEPTH, buffer);
+		return NULL;
+	}
+
+	if (!slot->buffer) {
+		struct base_allocator *allocator = staging_get_allocator(manager);
+		if (!allocator) {
+			return NULL;
+		}
+		slot->buffer = allocator->create_buffer(allocator, buffer->alloc_width, buffer->alloc_height,
+			buffer->fourcc, DRM_FORMAT_MOD_LINEAR, BASE_BUFFER_USAGE_CPU_WRITE);
+		if (!slot->buffer) {
+			log("Failed to allocate staging buffer for buffer %p", buffer);
+			return NULL;
+		}
+		slot->buffer->impl->lock(slot->buffer);
+		slot->valid = false;
+	}
+
+	struct base_rect damage = { 0, 0, buffer->alloc_width, buffer->alloc_height };
+	if (slot->valid) {
+		struct base_rect changed;
+		buffer->impl->get_damage(buffer, slot->serial, &changed);
+		const int32_t x_end = changed.x + changed.width < damage.width ? changed.x + changed.width : damage.width;
+		const int32_t y_end = changed.y + changed.height < damage.height ? changed.y + changed.height : damage.height;
+		damage.x = changed.x > 0 ? changed.x : 0;
+		damage.y = changed.y > 0 ? changed.y : 0;
+		damage.width = x_end - damage.x;
+		damage.height = y_end - damage.y;
+	}
+	if (damage.width > 0 && damage.height > 0) {
+		const uint32_t serial = buffer->serial;
+		if (!staging_copy(slot->buffer, buffer, &damage)) {
+			log("Failed to copy buffer %p into staging buffer", buffer);
+			slot->valid = false;
+			return NULL;
+		}
+		slot->serial = serial;
+		slot->valid = true;
+	}
+	return manager->base.create_wl_buffer(&manager->base, slot->buffer);
+}
+
+/*
+ * The wl_buffer always covers the whole allocation, so it stays valid when the
+ * pool re-uses the buffer for a smaller size. The surface crops it via wp_viewport.
+ */
+static struct wl_buffer *
+get_wl_buffer(struct wl_buffer_manager *manager, struct base_buffer *buffer)
+{
+	struct wl_buffer *wl_buffer = buffer->impl->get_attachment(buffer, manager);
 	if (wl_buffer) {
-		goto buffer_reuse;
+		return wl_buffer;
 	}
 
 	BUFFER_LOG(true, buffer, "Creating new wl_buffer");
@@ -293,25 +529,81 @@ buffer_manager_create_wl_buffer(struct base_wl_buffer_manager *_manager, struct
 			log("Failed to import shm buffer into compositor");
 		}
 	}
-	if (buffer->caps & BASE_ALLOCATOR_CAP_CPU_ACCESS) {
-		/*
-		 * TODO: Create own GBM buffer and memcpy the original buffer into it.
-		 *       Not quite sure how to synchronize updates though. So for now
-		 *       just do nothing and bail out.
-		 */
-	}
-
 	return NULL;
 
 buffer_created:
+	base_buffer_pool_count_wl_buffer(buffer);
 	wl_buffer_add_listener(wl_buffer, &wl_buffer_listener, buffer);
-	buffer->set_attachment(buffer, manager, wl_buffer, cb_attachment_destroy);
-
-buffer_reuse:
-	buffer->lock(buffer);
+	buffer->impl->set_attachment(buffer, manager, wl_buffer, cb_attachment_destroy);
 	return wl_buffer;
 }
 
+static struct wl_buffer *
+buffer_manager_create_wl_buffer(struct base_wl_buffer_manager *_manager, struct base_buffer *buffer)
+{
+	struct wl_buffer_manager *manager = (void *)_manager;
+	if (!buffer->impl->get_attachment(buffer, &manager->staging_allocator)) {
+		struct wl_buffer *wl_buffer = get_wl_buffer(manager, buffer);
+		if (wl_buffer) {
+			buffer->impl->lock(buffer);
+			return wl_buffer;
+		}
+	}
+
+	/* Staging buffers themselves must be exportable */
+	if (buffer->caps & BASE_ALLOCATOR_CAP_CPU_ACCESS && !(manager->staging_allocator
+			&& buffer->pool.owner == manager->staging_allocator->pool)) {
+		BUFFER_LOG(true, buffer, "Exporting via staging buffers");
+		return staging_create_wl_buffer(manager, buffer);
+	}
+	return NULL;
+}
+
+static bool
+buffer_manager_prepare_buffer(struct base_wl_buffer_manager *_manager, struct base_buffer *buffer)
+{
+	struct wl_buffer_manager *manager = (void *)_manager;
+	return !buffer->impl->get_attachment(buffer, &manager->staging_allocator)
+		&& get_wl_buffer(manager, buffer);
+}
+
+static void
+buffer_manager_destroy(struct base_wl_buffer_manager *_manager)
+{
+	struct wl_buffer_manager *manager = (void *)_manager;
+
+	/* Source buffers may outlive the manager, detach their staging buffers */
+	struct staging *staging, *tmp;
+	wl_list_for_each_safe(staging, tmp, &manager->stagings, link) {
+		for (uint32_t i = 0; i < STAGING_DEPTH; i++) {
+			if (staging->slots[i].buffer) {
+				staging->slots[i].buffer->impl->unlock(staging->slots[i].buffer);
+				staging->slots[i].buffer = NULL;
+				staging->slots[i].valid = false;
+			}
+		}
+		wl_list_remove(&staging->link);
+		staging->manager = NULL;
+	}
+	if (manager->staging_allocator) {
+		manager->staging_allocator->destroy(manager->staging_allocator);
+	}
+
+	if (manager->dmabuf.format_table) {
+		munmap(manager->dmabuf.format_table, manager->dmabuf.format_table_size);
+	}
+	if (manager->dmabuf.feedback) {
+		zwp_linux_dmabuf_feedback_v1_destroy(manager->dmabuf.feedback);
+	}
+	if (manager->dmabuf.global) {
+		zwp_linux_dmabuf_v1_destroy(manager->dmabuf.global);
+	}
+	if (manager->shm.global) {
+		wl_shm_destroy(manager->shm.global);
+	}
+	free(manager);
+}
+
 struct base_wl_buffer_manager *
 base_wl_buffer_manager_create(struct client *client)
 {
@@ -321,8 +613,11 @@ base_wl_buffer_manager_create(struct client *client)
 		.base = {
 			.client = client,
 			.create_wl_buffer = buffer_manager_create_wl_buffer,
+			.prepare_buffer = buffer_manager_prepare_buffer,
+			.destroy = buffer_manager_destroy,
 		},
 	};
+	wl_list_init(&manager->stagings);
 	client->add_handler(client, (struct client_handler){
 		.registry = handle_global,
 		.data = manager,
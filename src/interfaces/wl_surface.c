@@ -4,8 +4,10 @@
 #include "base.h"
 #include "buffer.h"
 #include "log.h"
+#include "swapchain.h"
 
 #include "cursor-shape-v1.xml.h"
+#include "viewporter.xml.h"
 
 #define SURFACE_CALLBACK(surface, name, ...) do {                \
 	struct surface_handler *handler;                         \
@@ -29,20 +31,66 @@ static void
 surface_set_render_func(struct surface *surface, void (*render_func)(struct base_buffer *buffer))
 {
 	surface->render_func = render_func;
+	surface->damage_render_func = NULL;
 }
 
 static void
-surface_set_buffer(struct surface *surface, struct base_buffer *buffer)
+surface_set_damage_render_func(struct surface *surface, void (*render_func)(struct base_buffer *buffer,
+		const struct base_rect *buffer_damage, struct base_rect *damage))
+{
+	surface->damage_render_func = render_func;
+}
+
+static void
+surface_update_viewport(struct surface *surface, struct base_buffer *buffer)
+{
+	/* Re-used buffers may be larger than their content, see buffer->alloc_width */
+	const bool cropped = buffer->width != buffer->alloc_width
+		|| buffer->height != buffer->alloc_height;
+	if (!cropped && !surface->cropped) {
+		return;
+	}
+	if (!surface->viewport) {
+		if (!surface->client->state.viewporter) {
+			log("Compositor does not support wp_viewporter, can't crop %ux%u buffer to %ux%u",
+				buffer->alloc_width, buffer->alloc_height, buffer->width, buffer->height);
+			return;
+		}
+		surface->viewport = wp_viewporter_get_viewport(
+			surface->client->state.viewporter, surface->surface);
+	}
+	if (cropped) {
+		wp_viewport_set_source(surface->viewport, 0, 0,
+			wl_fixed_from_int(buffer->width), wl_fixed_from_int(buffer->height));
+		wp_viewport_set_destination(surface->viewport, buffer->width, buffer->height);
+	} else {
+		wp_viewport_set_source(surface->viewport, wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+			wl_fixed_from_int(-1), wl_fixed_from_int(-1));
+		wp_viewport_set_destination(surface->viewport, -1, -1);
+	}
+	surface->cropped = cropped;
+}
+
+static void
+surface_attach(struct surface *surface, struct base_buffer *buffer, const struct base_rect *damage)
 {
 	assert(surface->surface);
-	wl_surface_attach(surface->surface, buffer->get_wl_buffer(buffer, surface->client), 0, 0);
-	wl_surface_damage_buffer(surface->surface, 0, 0, buffer->width, buffer->height);
+	surface_update_viewport(surface, buffer);
+	wl_surface_attach(surface->surface, buffer->impl->get_wl_buffer(buffer, surface->client), 0, 0);
+	wl_surface_damage_buffer(surface->surface, damage->x, damage->y, damage->width, damage->height);
 	wl_surface_commit(surface->surface);
 	surface->geometry.width = buffer->width;
 	surface->geometry.height = buffer->height;
 	wl_display_flush(surface->client->state.wl_display);
 }
 
+static void
+surface_set_buffer(struct surface *surface, struct base_buffer *buffer)
+{
+	const struct base_rect damage = { 0, 0, buffer->width, buffer->height };
+	surface_attach(surface, buffer, &damage);
+}
+
 static void
 frame_callback(void *data, struct wl_callback *wl_callback, uint32_t time_ms)
 {
@@ -76,12 +124,39 @@ surface_request_frame(struct surface *surface,
 static void
 surface_render_frame(struct surface *surface, uint32_t width, uint32_t height)
 {
-	struct base_allocator *pool = surface->client->shm_pool;
-	struct base_buffer *buffer = pool->create_buffer(
-		pool, width, height, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR
-	);
-	surface->render_func(buffer);
-	surface->set_buffer(surface, buffer);
+	if (!surface->swapchain) {
+		struct base_allocator *pool = surface->client->shm_pool;
+		surface->swapchain = base_swapchain_create(pool, BASE_SWAPCHAIN_DEFAULT_DEPTH,
+			width, height, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR,
+			BASE_BUFFER_USAGE_CPU_WRITE
+		);
+		assert(surface->swapchain);
+	}
+	struct base_swapchain *swapchain = surface->swapchain;
+	swapchain->resize(swapchain, width, height);
+	struct base_buffer *buffer = swapchain->acquire(swapchain);
+	if (!buffer) {
+		/* The compositor still holds all buffers */
+		return;
+	}
+	struct base_rect damage = { 0, 0, buffer->width, buffer->height };
+	if (surface->damage_render_func) {
+		struct base_rect buffer_damage;
+		swapchain->get_damage(swapchain, buffer, &buffer_damage);
+		struct base_rect frame_damage = { 0 };
+		surface->damage_render_func(buffer, &buffer_damage, &frame_damage);
+		/* Lets copies of the buffer, e.g. a staging upload, skip the untouched parts */
+		base_rect_union(&buffer_damage, &frame_damage);
+		buffer->impl->add_damage(buffer, &buffer_damage);
+		/* New buffers may differ in size, let the compositor update everything then */
+		if (buffer->age) {
+			damage = frame_damage;
+		}
+	} else {
+		surface->render_func(buffer);
+	}
+	surface_attach(surface, buffer, &damage);
+	swapchain->present(swapchain, buffer, &damage);
 }
 
 static void
@@ -94,6 +169,12 @@ surface_destroy(struct surface *surface)
 	if (surface->frame_callback.wl_callback) {
 		wl_callback_destroy(surface->frame_callback.wl_callback);
 	}
+	if (surface->viewport) {
+		wp_viewport_destroy(surface->viewport);
+	}
+	if (surface->swapchain) {
+		surface->swapchain->destroy(surface->swapchain);
+	}
 	wl_surface_destroy(surface->surface);
 	wl_array_release(&surface->callbacks);
 	free(surface);
@@ -162,6 +243,7 @@ surface_create(struct client *client)
 	surface->set_buffer = surface_set_buffer;
 	surface->request_frame = surface_request_frame;
 	surface->set_render_func = surface_set_render_func;
+	surface->set_damage_render_func = surface_set_damage_render_func;
 	surface->render_frame = surface_render_frame;
 	surface->unmap = surface_unmap;
 	surface->destroy = surface_destroy;
@@ -178,10 +178,10 @@ render_solid(struct base_buffer *buffer, uint32_t pixel_value)
 	assert(buffer->modifier == DRM_FORMAT_MOD_LINEAR);
 	assert(buffer->caps & BASE_ALLOCATOR_CAP_CPU_ACCESS);
 
-	void *pixels = buffer->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
 	assert(pixels);
 	raw_render_solid(pixels, buffer->width, buffer->height, buffer->stride, pixel_value);
-	buffer->get_pixels_end(buffer, pixels);
+	buffer->impl->get_pixels_end(buffer, pixels);
 }
 
 void
@@ -197,10 +197,10 @@ render_checkerboard(struct base_buffer *buffer)
 	assert(buffer->modifier == DRM_FORMAT_MOD_LINEAR);
 	assert(buffer->caps & BASE_ALLOCATOR_CAP_CPU_ACCESS);
 
-	void *pixels = buffer->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
 	assert(pixels);
 	raw_render_checkerboard(pixels, buffer->width, buffer->height, buffer->stride);
-	buffer->get_pixels_end(buffer, pixels);
+	buffer->impl->get_pixels_end(buffer, pixels);
 }
 
 void
@@ -210,8 +210,8 @@ render_gradient(struct base_buffer *buffer, uint8_t blue)
 	assert(buffer->modifier == DRM_FORMAT_MOD_LINEAR);
 	assert(buffer->caps & BASE_ALLOCATOR_CAP_CPU_ACCESS);
 
-	void *pixels = buffer->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
+	void *pixels = buffer->impl->get_pixels(buffer, BASE_ALLOCATOR_REQ_WRITE);
 	assert(pixels);
 	raw_render_gradient(pixels, buffer->width, buffer->height, buffer->stride, blue);
-	buffer->get_pixels_end(buffer, pixels);
+	buffer->impl->get_pixels_end(buffer, pixels);
 }